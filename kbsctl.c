@@ -0,0 +1,463 @@
+/*
+ * PROJECT:         Keyboard Layout Switcher
+ * FILE:            base/applications/kbswitch/kbsctl.c
+ * PURPOSE:         Command line client of the kbswitch control channel
+ * PROGRAMMERS:     Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+
+#include "kbswitch.h"
+#include "kbssnap.h"
+#include "kbssec.h"
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Requests in flight at once in the benchmark */
+#define BENCH_BATCH 64
+
+static void Usage(void)
+{
+    puts("Usage: kbsctl state\n"
+         "       kbsctl switch <KLID>\n"
+         "       kbsctl list\n"
+         "       kbsctl counters\n"
+         "       kbsctl handles\n"
+         "       kbsctl bench [count]\n"
+         "       kbsctl dllcost [kbsdll.dll]\n"
+         "       kbsctl snapshot [watch | bench [count]]\n"
+         "       kbsctl trace start\n"
+         "       kbsctl trace stop [file.json]");
+}
+
+/*
+ * Any process could have created the pipe before kbswitch. Only a server of
+ * this session whose pipe is owned by this user (or by the administrators or
+ * the system) is talked to.
+ */
+static BOOL IsControlServerTrusted(HANDLE hPipe)
+{
+    ULONG dwServerId = 0;
+    DWORD dwServerSessionId = 0, dwSessionId = 0;
+
+    return GetNamedPipeServerProcessId(hPipe, &dwServerId) &&
+           ProcessIdToSessionId(dwServerId, &dwServerSessionId) &&
+           ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId) &&
+           dwServerSessionId == dwSessionId &&
+           KbsIsTrustedOwner(hPipe);
+}
+
+static HANDLE OpenControlPipe(void)
+{
+    TCHAR szPipeName[MAX_PATH];
+    DWORD dwSessionId = 0, dwMode = PIPE_READMODE_BYTE;
+    HANDLE hPipe;
+    INT iTry;
+
+    ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId);
+    StringCchPrintf(szPipeName, _countof(szPipeName), KBSCTL_PIPE_FORMAT, dwSessionId);
+
+    for (iTry = 0; iTry < 10; ++iTry)
+    {
+        hPipe = CreateFile(szPipeName, GENERIC_READ | GENERIC_WRITE | READ_CONTROL, 0, NULL,
+                           OPEN_EXISTING, 0, NULL);
+        if (hPipe != INVALID_HANDLE_VALUE)
+        {
+            if (!IsControlServerTrusted(hPipe))
+            {
+                CloseHandle(hPipe);
+                SetLastError(ERROR_ACCESS_DENIED);
+                return INVALID_HANDLE_VALUE;
+            }
+
+            SetNamedPipeHandleState(hPipe, &dwMode, NULL, NULL);
+            return hPipe;
+        }
+
+        /* The server is between two clients */
+        if (GetLastError() != ERROR_PIPE_BUSY && GetLastError() != ERROR_FILE_NOT_FOUND)
+            break;
+        WaitNamedPipe(szPipeName, 100);
+    }
+
+    return INVALID_HANDLE_VALUE;
+}
+
+static BOOL WriteAll(HANDLE hPipe, LPCVOID pv, DWORD cb)
+{
+    DWORD cbWritten;
+
+    while (cb > 0)
+    {
+        if (!WriteFile(hPipe, pv, cb, &cbWritten, NULL) || cbWritten == 0)
+            return FALSE;
+        pv = (const BYTE *)pv + cbWritten;
+        cb -= cbWritten;
+    }
+
+    return TRUE;
+}
+
+static BOOL ReadAll(HANDLE hPipe, LPVOID pv, DWORD cb)
+{
+    DWORD cbRead;
+
+    while (cb > 0)
+    {
+        if (!ReadFile(hPipe, pv, cb, &cbRead, NULL) || cbRead == 0)
+            return FALSE;
+        pv = (BYTE *)pv + cbRead;
+        cb -= cbRead;
+    }
+
+    return TRUE;
+}
+
+// Sends a request and receives its response. *ppvData is LocalAlloc'ed.
+static BOOL
+Transact(HANDLE hPipe, DWORD dwCommand, DWORD dwParam, PKBSCTL_RESPONSE pResponse, LPVOID *ppvData)
+{
+    KBSCTL_REQUEST Request = { dwCommand, dwParam };
+
+    *ppvData = NULL;
+
+    if (!WriteAll(hPipe, &Request, sizeof(Request)) ||
+        !ReadAll(hPipe, pResponse, sizeof(*pResponse)))
+    {
+        return FALSE;
+    }
+
+    if (pResponse->cbData == 0)
+        return TRUE;
+
+    *ppvData = LocalAlloc(LPTR, pResponse->cbData);
+    if (*ppvData == NULL)
+        return FALSE;
+
+    return ReadAll(hPipe, *ppvData, pResponse->cbData);
+}
+
+static int Bench(HANDLE hPipe, DWORD cRequests)
+{
+    KBSCTL_REQUEST aRequests[BENCH_BATCH];
+    KBSCTL_RESPONSE Response;
+    KBSCTL_STATE State;
+    LARGE_INTEGER liFreq, liBegin, liEnd, liSent, liReceived;
+    double usTotal, usRoundTrip = 0;
+    DWORD iDone, cBatch, i;
+
+    for (i = 0; i < BENCH_BATCH; ++i)
+    {
+        aRequests[i].dwCommand = KBSCTL_GET_STATE;
+        aRequests[i].dwParam = 0;
+    }
+
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liBegin);
+
+    for (iDone = 0; iDone < cRequests; iDone += cBatch)
+    {
+        cBatch = min(cRequests - iDone, BENCH_BATCH);
+
+        QueryPerformanceCounter(&liSent);
+        if (!WriteAll(hPipe, aRequests, cBatch * sizeof(KBSCTL_REQUEST)))
+            return 1;
+
+        for (i = 0; i < cBatch; ++i)
+        {
+            if (!ReadAll(hPipe, &Response, sizeof(Response)) || Response.cbData != sizeof(State) ||
+                !ReadAll(hPipe, &State, sizeof(State)))
+            {
+                return 1;
+            }
+
+            if (i == 0)
+            {
+                QueryPerformanceCounter(&liReceived);
+                usRoundTrip += (liReceived.QuadPart - liSent.QuadPart) * 1e6 / liFreq.QuadPart;
+            }
+        }
+    }
+
+    QueryPerformanceCounter(&liEnd);
+    usTotal = (liEnd.QuadPart - liBegin.QuadPart) * 1e6 / liFreq.QuadPart;
+
+    printf("%lu requests in %.1f ms: %.0f requests/s, first response of a batch after %.1f us\n",
+           cRequests, usTotal / 1000, cRequests * 1e6 / usTotal,
+           usRoundTrip / ((cRequests + BENCH_BATCH - 1) / BENCH_BATCH));
+    return 0;
+}
+
+// Measures what loading kbsdll costs each process the hooks are injected into
+static int DllCost(LPCSTR pszPath)
+{
+    PROCESS_MEMORY_COUNTERS_EX Before, After;
+    LARGE_INTEGER liFreq, liBegin, liEnd;
+    PIMAGE_NT_HEADERS pNtHeaders;
+    HMODULE hDLL;
+
+    Before.cb = After.cb = sizeof(PROCESS_MEMORY_COUNTERS_EX);
+    GetProcessMemoryInfo(GetCurrentProcess(), (PPROCESS_MEMORY_COUNTERS)&Before, sizeof(Before));
+
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liBegin);
+    hDLL = LoadLibraryA(pszPath);
+    QueryPerformanceCounter(&liEnd);
+    if (hDLL == NULL)
+    {
+        fprintf(stderr, "kbsctl: cannot load %s (%lu)\n", pszPath, GetLastError());
+        return 1;
+    }
+
+    GetProcessMemoryInfo(GetCurrentProcess(), (PPROCESS_MEMORY_COUNTERS)&After, sizeof(After));
+    pNtHeaders = (PIMAGE_NT_HEADERS)((LPBYTE)hDLL + ((PIMAGE_DOS_HEADER)hDLL)->e_lfanew);
+
+    printf("Image size: %lu KB\n", pNtHeaders->OptionalHeader.SizeOfImage / 1024);
+    printf("Load time: %.1f us\n", (liEnd.QuadPart - liBegin.QuadPart) * 1e6 / liFreq.QuadPart);
+    printf("Private bytes: %+ld KB\n",
+           (LONG)((LONG_PTR)After.PrivateUsage - (LONG_PTR)Before.PrivateUsage) / 1024);
+    printf("Working set: %+ld KB\n",
+           (LONG)((LONG_PTR)After.WorkingSetSize - (LONG_PTR)Before.WorkingSetSize) / 1024);
+
+    FreeLibrary(hDLL);
+    return 0;
+}
+
+// Writes the spans as Chrome trace events, for chrome://tracing and Perfetto
+static int WriteTrace(const KBSCTL_SPAN *pSpans, DWORD cSpans, LPCSTR pszFile)
+{
+    FILE *fp = pszFile ? fopen(pszFile, "w") : stdout;
+    DWORD i;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "kbsctl: cannot write %s\n", pszFile);
+        return 1;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+          "\"args\":{\"name\":\"kbswitch\"}}", fp);
+    for (i = 0; i < cSpans; ++i)
+    {
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+                    "\"ts\":%I64u,\"dur\":%lu,\"args\":{\"arg\":\"0x%lX\"}}",
+                pSpans[i].szName, pSpans[i].dwThreadId, pSpans[i].qwBegin,
+                pSpans[i].dwDuration, pSpans[i].dwArg);
+    }
+    fputs("\n]}\n", fp);
+
+    if (pszFile)
+    {
+        fclose(fp);
+        printf("%lu spans written to %s\n", cSpans, pszFile);
+    }
+    return 0;
+}
+
+static void PrintSnapshot(const KBS_SNAPSHOT_DATA *pData, DWORD dwSequence)
+{
+    printf("#%lu: HKL %08I64X, KLID %08lX, %ls, window %08I64X: %ls\n",
+           dwSequence, pData->qwHKL, pData->dwKLID, pData->szBadge,
+           pData->qwForeground, pData->szText);
+}
+
+// Reads the snapshot that kbswitch publishes, without talking to it
+static int Snapshot(int argc, char **argv)
+{
+    KBS_SNAPSHOT_READER Reader;
+    KBS_SNAPSHOT_DATA Data;
+    LARGE_INTEGER liFreq, liBegin, liEnd;
+    DWORD dwSequence, cReads, i;
+    double usTotal;
+
+    if (!KbsSnapOpen(&Reader))
+    {
+        fprintf(stderr, "kbsctl: kbswitch is not running (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    if (argc >= 3 && lstrcmpiA(argv[2], "watch") == 0)
+    {
+        while (KbsSnapRead(&Reader, &Data, &dwSequence))
+        {
+            PrintSnapshot(&Data, dwSequence);
+            fflush(stdout);
+            KbsSnapWait(&Reader, dwSequence, INFINITE);
+        }
+    }
+    else if (argc >= 3 && lstrcmpiA(argv[2], "bench") == 0)
+    {
+        cReads = (argc >= 4) ? strtoul(argv[3], NULL, 10) : 1000000;
+
+        QueryPerformanceFrequency(&liFreq);
+        QueryPerformanceCounter(&liBegin);
+        for (i = 0; i < cReads; ++i)
+            KbsSnapRead(&Reader, &Data, &dwSequence);
+        QueryPerformanceCounter(&liEnd);
+
+        usTotal = (liEnd.QuadPart - liBegin.QuadPart) * 1e6 / liFreq.QuadPart;
+        printf("%lu reads in %.1f ms: %.0f ns each\n", cReads, usTotal / 1000,
+               usTotal * 1000 / max(cReads, 1));
+    }
+    else if (KbsSnapRead(&Reader, &Data, &dwSequence))
+    {
+        PrintSnapshot(&Data, dwSequence);
+    }
+
+    KbsSnapClose(&Reader);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    HANDLE hPipe;
+    KBSCTL_RESPONSE Response;
+    LPVOID pvData;
+    DWORD dwCommand, dwParam = 0, i;
+    int ret = 0;
+
+    if (argc < 2)
+    {
+        Usage();
+        return 2;
+    }
+
+    if (lstrcmpiA(argv[1], "snapshot") == 0)
+        return Snapshot(argc, argv);
+
+    if (lstrcmpiA(argv[1], "dllcost") == 0)
+        return DllCost((argc >= 3) ? argv[2] : "kbsdll.dll");
+
+    if (lstrcmpiA(argv[1], "state") == 0)
+        dwCommand = KBSCTL_GET_STATE;
+    else if (lstrcmpiA(argv[1], "switch") == 0 && argc >= 3)
+        dwCommand = KBSCTL_SET_LAYOUT, dwParam = strtoul(argv[2], NULL, 16);
+    else if (lstrcmpiA(argv[1], "list") == 0)
+        dwCommand = KBSCTL_LIST_LAYOUTS;
+    else if (lstrcmpiA(argv[1], "counters") == 0)
+        dwCommand = KBSCTL_GET_COUNTERS;
+    else if (lstrcmpiA(argv[1], "handles") == 0)
+        dwCommand = KBSCTL_GET_HANDLES;
+    else if (lstrcmpiA(argv[1], "trace") == 0 && argc >= 3 && lstrcmpiA(argv[2], "start") == 0)
+        dwCommand = KBSCTL_TRACE, dwParam = 1;
+    else if (lstrcmpiA(argv[1], "trace") == 0 && argc >= 3 && lstrcmpiA(argv[2], "stop") == 0)
+        dwCommand = KBSCTL_TRACE, dwParam = 0;
+    else if (lstrcmpiA(argv[1], "bench") == 0)
+        dwCommand = 0, dwParam = (argc >= 3) ? strtoul(argv[2], NULL, 10) : 10000;
+    else
+    {
+        Usage();
+        return 2;
+    }
+
+    hPipe = OpenControlPipe();
+    if (hPipe == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "kbsctl: kbswitch is not running (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    if (dwCommand == 0)
+    {
+        ret = Bench(hPipe, dwParam);
+        CloseHandle(hPipe);
+        return ret;
+    }
+
+    if (!Transact(hPipe, dwCommand, dwParam, &Response, &pvData))
+    {
+        fprintf(stderr, "kbsctl: the connection failed (%lu)\n", GetLastError());
+        CloseHandle(hPipe);
+        return 1;
+    }
+    CloseHandle(hPipe);
+
+    if (Response.dwStatus != ERROR_SUCCESS)
+    {
+        fprintf(stderr, "kbsctl: the request failed (%lu)\n", Response.dwStatus);
+        LocalFree(pvData);
+        return 1;
+    }
+
+    switch (dwCommand)
+    {
+        case KBSCTL_GET_STATE:
+        {
+            PKBSCTL_STATE pState = pvData;
+            printf("HKL: %08I64X\nKLID: %08lX\nLast active: %08I64X\n",
+                   pState->qwHKL, pState->dwKLID, pState->qwLastActive);
+            break;
+        }
+
+        case KBSCTL_LIST_LAYOUTS:
+        {
+            PKBSCTL_LAYOUT pLayout = pvData;
+            for (i = 0; i < Response.cbData / sizeof(KBSCTL_LAYOUT); ++i)
+            {
+                printf("%08lX %04lX %ls\n", pLayout[i].dwKLID, pLayout[i].dwVariant,
+                       pLayout[i].szText);
+            }
+            break;
+        }
+
+        case KBSCTL_GET_COUNTERS:
+        {
+            PKBS_COUNTERS pCounters = pvData;
+            printf("Events received: %lu\n", pCounters->cEventsReceived);
+            printf("Events coalesced: %lu\n", pCounters->cEventsCoalesced);
+            printf("Events dropped: %lu\n", pCounters->cEventsDropped);
+            printf("Drains: %lu\n", pCounters->cDrains);
+            printf("Max queue depth: %lu\n", pCounters->cMaxQueueDepth);
+            printf("Event delay: max %lu ms, average %lu ms\n", pCounters->dwMaxEventDelay,
+                   pCounters->dwTotalEventDelay / max(pCounters->cEventsReceived, 1));
+            printf("Direct activations: %lu\n", pCounters->cActivationsDirect);
+            printf("Fallback activations: %lu\n", pCounters->cActivationsFallback);
+            printf("Layout cache: %lu hits, %lu misses, %lu evictions\n",
+                   pCounters->cLayoutCacheHits, pCounters->cLayoutCacheMisses,
+                   pCounters->cLayoutCacheEvictions);
+            printf("Global mode: %lu propagations, %lu switches, %lu skips, %lu deferrals\n",
+                   pCounters->cPropagations, pCounters->cPropagationSwitches,
+                   pCounters->cPropagationSkips, pCounters->cPropagationDeferrals);
+            printf("Last propagation: %lu windows in %luus (max %luus)\n",
+                   pCounters->cLastPropagationWindows, pCounters->dwLastPropagationTime,
+                   pCounters->dwMaxPropagationTime);
+            printf("Stalls: %lu activation timeouts, %lu unresponsive skips, "
+                   "%lu slow drains (max %lums)\n",
+                   pCounters->cActivationTimeouts, pCounters->cUnresponsiveSkips,
+                   pCounters->cSlowDrains, pCounters->dwMaxDrainTime);
+            printf("Spans dropped: %lu\n", pCounters->cSpansDropped);
+            printf("Hook events posted: %ld\n", pCounters->Hook.cPosted);
+            printf("Hook events failed: %ld\n", pCounters->Hook.cPostFailed);
+            printf("Hooked processes: %ld\n", pCounters->Hook.cProcesses);
+            break;
+        }
+
+        case KBSCTL_GET_HANDLES:
+        {
+            static const char *s_apszOwners[KBS_HANDLE_OWNERS] = { "Tray", "Menu", "Icon drawing" };
+            PKBSCTL_HANDLES pHandles = pvData;
+            printf("GDI objects: %lu (peak %lu)\n", pHandles->cGdiObjects, pHandles->cGdiPeak);
+            printf("USER objects: %lu (peak %lu)\n", pHandles->cUserObjects, pHandles->cUserPeak);
+            for (i = 0; i < KBS_HANDLE_OWNERS; ++i)
+            {
+                printf("%s: %ld live, peak %ld, %lu created\n", s_apszOwners[i],
+                       pHandles->Accounts[i].cLive, pHandles->Accounts[i].cPeak,
+                       pHandles->Accounts[i].cCreated);
+            }
+            break;
+        }
+
+        case KBSCTL_TRACE:
+        {
+            if (dwParam == 0)
+            {
+                ret = WriteTrace(pvData, Response.cbData / sizeof(KBSCTL_SPAN),
+                                 (argc >= 4) ? argv[3] : NULL);
+            }
+            break;
+        }
+    }
+
+    LocalFree(pvData);
+    return ret;
+}
@@ -1,17 +1,105 @@
 #include "kbswitch.h"
+#include "kbssec.h"
+
+/*
+ * kbsdll.dll is injected into every GUI process on the desktop by the global
+ * hooks, so it is built without the CRT. The state it shares with kbswitch
+ * (the window to notify, the event mask, the counters and the activations) is
+ * kept in a named mapping of the session, not in a shared data section: HWNDs
+ * only mean something in their own session, and the kbswitch of each session
+ * has a state of its own. kbswitch creates the mapping in KbsHook, open to its
+ * user alone, and refuses one that someone else created first; a hooked
+ * process opens it the first time it needs it. A process that cannot write it,
+ * such as one of a low integrity level, only reads it.
+ */
+#define KBS_STATE_NAME TEXT("Local\\kbsdll.State.1")
+
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+    #define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#endif
+
+typedef struct tagKBS_HOOK_STATE
+{
+    DWORD64 qwHwnd;         /* The window to notify; zero when unhooked */
+    DWORD dwEventMask;
+    UINT uActivateMsg;
+    LONG lActivationSeq;
+    KBS_HOOK_COUNTERS Counters;
+    KBS_ACTIVATION Activations[KBS_MAX_ACTIVATIONS];
+} KBS_HOOK_STATE, *PKBS_HOOK_STATE;
 
 HINSTANCE g_hinstDLL = NULL;
+PKBS_HOOK_STATE g_pState = NULL;    /* The view of this process */
+HANDLE g_hStateMapping = NULL;
+BOOL g_bStateWritable = FALSE;
+LONG g_lStateOpened = FALSE;        /* Tried once per process */
+BOOL g_bCounted = FALSE;            /* In cProcesses */
+
+/* Only in kbswitch; CallNextHookEx ignores its hook argument since NT */
 HHOOK g_hShellHook = NULL;
 HHOOK g_hCbtHook = NULL;
-HWND g_hwnd = NULL;
+HHOOK g_ahActivationHooks[KBS_MAX_ACTIVATIONS] = { NULL };   /* Of the target threads */
+DWORD g_dwEventMask = KBS_EVENT_ALL;
 
-static VOID
-PostMessageToMainWnd(UINT uMsg, WPARAM wParam, LPARAM lParam)
+static PKBS_HOOK_STATE GetHookState(VOID)
 {
-    if (g_hwnd)
-        PostMessage(g_hwnd, uMsg, wParam, lParam);
+    HANDLE hMapping;
+    PKBS_HOOK_STATE pState;
+    DWORD dwAccess = FILE_MAP_READ | FILE_MAP_WRITE;
+
+    if (g_pState || InterlockedExchange(&g_lStateOpened, TRUE))
+        return g_pState;
+
+    hMapping = OpenFileMapping(dwAccess, FALSE, KBS_STATE_NAME);
+    if (!hMapping)
+    {
+        dwAccess = FILE_MAP_READ;
+        hMapping = OpenFileMapping(dwAccess, FALSE, KBS_STATE_NAME);
+        if (!hMapping)
+            return NULL;
+    }
+
+    pState = (PKBS_HOOK_STATE)MapViewOfFile(hMapping, dwAccess, 0, 0, sizeof(KBS_HOOK_STATE));
+    if (!pState)
+    {
+        CloseHandle(hMapping);
+        return NULL;
+    }
+
+    g_hStateMapping = hMapping;
+    g_bStateWritable = (dwAccess & FILE_MAP_WRITE) != 0;
+    if (g_bStateWritable)
+    {
+        InterlockedIncrement(&pState->Counters.cProcesses);
+        g_bCounted = TRUE;
+    }
+    InterlockedExchangePointer((PVOID volatile *)&g_pState, pState);
+    return pState;
 }
 
+static VOID
+PostMessageToMainWnd(DWORD dwEvent, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    PKBS_HOOK_STATE pState = GetHookState();
+    HWND hwnd;
+
+    if (!pState)
+        return;
+
+    hwnd = (HWND)(ULONG_PTR)pState->qwHwnd;
+    if (!hwnd || !(pState->dwEventMask & dwEvent))
+        return;
+
+    if (PostMessage(hwnd, uMsg, wParam, lParam))
+    {
+        if (g_bStateWritable)
+            InterlockedIncrement(&pState->Counters.cPosted);
+    }
+    else if (g_bStateWritable)
+    {
+        InterlockedIncrement(&pState->Counters.cPostFailed);
+    }
+}
 LRESULT CALLBACK
 ShellProc(
     INT nCode,
@@ -19,27 +107,27 @@ ShellProc(
     LPARAM lParam)
 {
     if (nCode < 0)
-        return CallNextHookEx(g_hShellHook, nCode, wParam, lParam);
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
 
     switch (nCode)
     {
     case HSHELL_LANGUAGE:
-        PostMessageToMainWnd(WM_LANGUAGE, wParam, lParam);
+        PostMessageToMainWnd(KBS_EVENT_LANGUAGE, WM_LANGUAGE, wParam, lParam);
         break;
     case HSHELL_WINDOWACTIVATED:
-        PostMessageToMainWnd(WM_WINDOWACTIVATED, wParam, lParam);
+        PostMessageToMainWnd(KBS_EVENT_ACTIVATED, WM_WINDOWACTIVATED, wParam, lParam);
         break;
     case HSHELL_WINDOWCREATED:
-        PostMessageToMainWnd(WM_WINDOWCREATED, wParam, lParam);
+        PostMessageToMainWnd(KBS_EVENT_CREATED, WM_WINDOWCREATED, wParam, lParam);
         break;
     case HSHELL_WINDOWDESTROYED:
-        PostMessageToMainWnd(WM_WINDOWDESTROYED, wParam, lParam);
+        PostMessageToMainWnd(KBS_EVENT_DESTROYED, WM_WINDOWDESTROYED, wParam, lParam);
         break;
     default:
         break;
     }
 
-    return CallNextHookEx(g_hShellHook, nCode, wParam, lParam);
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
 }
 
 LRESULT CALLBACK
@@ -49,23 +137,244 @@ CbtProc(
     LPARAM lParam)
 {
     if (nCode < 0)
-        return CallNextHookEx(g_hCbtHook, nCode, wParam, lParam);
+        return CallNextHookEx(NULL, nCode, wParam, lParam);
 
     switch (nCode)
     {
     case HCBT_SETFOCUS:
-        PostMessageToMainWnd(WM_WINDOWSETFOCUS, wParam, lParam);
+        PostMessageToMainWnd(KBS_EVENT_SETFOCUS, WM_WINDOWSETFOCUS, wParam, lParam);
         break;
     default:
         break;
     }
 
-    return CallNextHookEx(g_hShellHook, nCode, wParam, lParam);
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
+}
+
+
+/*
+ * Activation of a layout on the target's own thread.
+ *
+ * ActivateKeyboardLayout only works for the calling thread since XP. kbswitch
+ * fills a slot of the activations, hooks WH_GETMESSAGE of the target's thread
+ * alone and posts uActivateMsg to the target window with the sequence number
+ * of the command. The hook picks it up on the thread of the window, activates
+ * the layout there and posts WM_LAYOUTACTIVATED back. The message is turned
+ * into WM_NULL so that the window never sees it. The hook is removed when the
+ * command is done or cancelled, so no other thread ever calls it.
+ *
+ * A process of the other bitness cannot load kbsdll; the system would call the
+ * hook in kbswitch instead, where it cannot activate anything. Those targets
+ * are left to WM_INPUTLANGCHANGEREQUEST.
+ */
+static VOID RunActivation(PKBS_HOOK_STATE pState, DWORD dwSeq)
+{
+    PKBS_ACTIVATION pActivation = &pState->Activations[dwSeq % KBS_MAX_ACTIVATIONS];
+    HWND hwnd;
+    BOOL bSucceeded;
+
+    if (pActivation->dwSeq != dwSeq || pActivation->dwThreadId != GetCurrentThreadId())
+        return;
+
+    if (InterlockedCompareExchange(&pActivation->lState, KBS_ACTIVATION_RUNNING,
+                                   KBS_ACTIVATION_QUEUED) != KBS_ACTIVATION_QUEUED)
+    {
+        return; /* Cancelled */
+    }
+
+    bSucceeded = (ActivateKeyboardLayout((HKL)(ULONG_PTR)pActivation->qwHKL, 0) != NULL);
+    InterlockedExchange(&pActivation->lState, KBS_ACTIVATION_FREE);
+
+    hwnd = (HWND)(ULONG_PTR)pState->qwHwnd;
+    if (hwnd)
+        PostMessage(hwnd, WM_LAYOUTACTIVATED, dwSeq, bSucceeded);
+}
+
+LRESULT CALLBACK
+GetMsgProc(
+    INT nCode,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+    MSG *pMsg = (MSG *)lParam;
+    PKBS_HOOK_STATE pState;
+
+    if (nCode == HC_ACTION && wParam == PM_REMOVE)
+    {
+        pState = GetHookState();
+        if (pState && pState->uActivateMsg && pMsg->message == pState->uActivateMsg)
+        {
+            if (g_bStateWritable)
+                RunActivation(pState, (DWORD)pMsg->wParam);
+            pMsg->message = WM_NULL;
+        }
+    }
+
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
+}
+
+static BOOL IsSameBitness(DWORD dwProcessId)
+{
+    HANDLE hProcess;
+    BOOL bWow64 = FALSE, bTargetWow64 = FALSE, bSame;
+
+    hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, dwProcessId);
+    if (!hProcess)
+        return FALSE;
+
+    bSame = IsWow64Process(GetCurrentProcess(), &bWow64) &&
+            IsWow64Process(hProcess, &bTargetWow64) &&
+            bWow64 == bTargetWow64;
+    CloseHandle(hProcess);
+    return bSame;
+}
+
+static VOID RemoveActivationHook(DWORD dwSlot)
+{
+    if (g_ahActivationHooks[dwSlot])
+    {
+        UnhookWindowsHookEx(g_ahActivationHooks[dwSlot]);
+        g_ahActivationHooks[dwSlot] = NULL;
+    }
+}
+
+/* Returns the sequence number of the command, or zero if it cannot be queued */
+DWORD KbsActivateLayout(HWND hwndTarget, HKL hKL)
+{
+    PKBS_HOOK_STATE pState = g_pState;
+    PKBS_ACTIVATION pActivation;
+    DWORD dwSeq, dwSlot, dwThreadId, dwProcessId = 0;
+
+    dwThreadId = GetWindowThreadProcessId(hwndTarget, &dwProcessId);
+    if (!pState || !pState->uActivateMsg || !dwThreadId || !IsSameBitness(dwProcessId))
+        return 0;
+
+    dwSeq = (DWORD)InterlockedIncrement(&pState->lActivationSeq);
+    if (dwSeq == 0)
+        dwSeq = (DWORD)InterlockedIncrement(&pState->lActivationSeq);
+
+    dwSlot = dwSeq % KBS_MAX_ACTIVATIONS;
+    pActivation = &pState->Activations[dwSlot];
+    if (InterlockedCompareExchange(&pActivation->lState, KBS_ACTIVATION_FILLING,
+                                   KBS_ACTIVATION_FREE) != KBS_ACTIVATION_FREE)
+    {
+        return 0;
+    }
+
+    /* The hook of a command run but never ended */
+    RemoveActivationHook(dwSlot);
+
+    pActivation->dwSeq = dwSeq;
+    pActivation->dwThreadId = dwThreadId;
+    pActivation->qwHKL = (ULONG_PTR)hKL;
+
+    g_ahActivationHooks[dwSlot] = SetWindowsHookEx(WH_GETMESSAGE, GetMsgProc, g_hinstDLL,
+                                                   dwThreadId);
+    if (!g_ahActivationHooks[dwSlot])
+    {
+        InterlockedExchange(&pActivation->lState, KBS_ACTIVATION_FREE);
+        return 0;
+    }
+
+    InterlockedExchange(&pActivation->lState, KBS_ACTIVATION_QUEUED);
+
+    if (!PostMessage(hwndTarget, pState->uActivateMsg, dwSeq, 0))
+    {
+        InterlockedExchange(&pActivation->lState, KBS_ACTIVATION_FREE);
+        RemoveActivationHook(dwSlot);
+        return 0;
+    }
+
+    return dwSeq;
+}
+
+/*
+ * Ends the command: removes its hook, and cancels it if it has not run yet.
+ * kbswitch calls it for every command. Returns FALSE if it has already run.
+ */
+BOOL KbsCancelActivation(DWORD dwSeq)
+{
+    PKBS_ACTIVATION pActivation;
+    DWORD dwSlot = dwSeq % KBS_MAX_ACTIVATIONS;
+    BOOL bCancelled;
+
+    if (!g_pState)
+        return FALSE;
+
+    pActivation = &g_pState->Activations[dwSlot];
+    if (pActivation->dwSeq != dwSeq)
+        return FALSE;
+
+    bCancelled = (InterlockedCompareExchange(&pActivation->lState, KBS_ACTIVATION_FREE,
+                                             KBS_ACTIVATION_QUEUED) == KBS_ACTIVATION_QUEUED);
+    RemoveActivationHook(dwSlot);
+    return bCancelled;
+}
+
+/*
+ * Creates the state of the session, open to this user alone, or takes over the
+ * one a previous kbswitch left to the processes still holding it. A state that
+ * someone else has created is refused, and kbswitch runs without the hooks.
+ */
+static PKBS_HOOK_STATE CreateHookState(VOID)
+{
+    PKBS_HOOK_STATE pState;
+    KBS_USER_SECURITY Security;
+    MEMORY_BASIC_INFORMATION mbi;
+    HANDLE hMapping;
+    INT i;
+
+    if (!g_hStateMapping)
+    {
+        hMapping = CreateFileMapping(INVALID_HANDLE_VALUE, KbsInitUserSecurity(&Security),
+                                     PAGE_READWRITE, 0, sizeof(KBS_HOOK_STATE), KBS_STATE_NAME);
+        if (!hMapping)
+            return NULL;
+
+        if (GetLastError() == ERROR_ALREADY_EXISTS && !KbsIsTrustedOwner(hMapping))
+        {
+            CloseHandle(hMapping);
+            return NULL;
+        }
+        g_hStateMapping = hMapping;
+    }
+
+    if (!g_pState)
+    {
+        pState = (PKBS_HOOK_STATE)MapViewOfFile(g_hStateMapping, FILE_MAP_READ | FILE_MAP_WRITE,
+                                                0, 0, 0);
+        if (!pState)
+            return NULL;
+
+        if (!VirtualQuery(pState, &mbi, sizeof(mbi)) || mbi.RegionSize < sizeof(KBS_HOOK_STATE))
+        {
+            UnmapViewOfFile(pState);
+            return NULL;
+        }
+        g_pState = pState;
+        g_bStateWritable = TRUE;
+        g_lStateOpened = TRUE;
+    }
+
+    pState = g_pState;
+    pState->qwHwnd = 0;
+    pState->dwEventMask = g_dwEventMask;
+    pState->Counters.cPosted = pState->Counters.cPostFailed = 0;
+    for (i = 0; i < KBS_MAX_ACTIVATIONS; ++i)
+        InterlockedExchange(&pState->Activations[i].lState, KBS_ACTIVATION_FREE);
+    return pState;
 }
 
 BOOL KbsHook(HWND hwnd)
 {
-    g_hwnd = hwnd;
+    PKBS_HOOK_STATE pState = CreateHookState();
+
+    if (!pState)
+        return FALSE;
+
+    /* Optional; without it, kbswitch falls back to WM_INPUTLANGCHANGEREQUEST */
+    pState->uActivateMsg = RegisterWindowMessage(TEXT("kbsdll.ActivateLayout"));
+    pState->qwHwnd = (ULONG_PTR)hwnd;
 
     g_hShellHook = SetWindowsHookEx(WH_SHELL, ShellProc, g_hinstDLL, 0);
     g_hCbtHook = SetWindowsHookEx(WH_CBT, CbtProc, g_hinstDLL, 0);
@@ -74,28 +383,59 @@ BOOL KbsHook(HWND hwnd)
         UnhookWindowsHookEx(g_hShellHook);
         UnhookWindowsHookEx(g_hCbtHook);
         g_hShellHook = g_hCbtHook = NULL;
+        pState->qwHwnd = 0;
         return FALSE;
     }
 
     return TRUE;
 }
 
+/* Only clears the state of this session */
 void KbsUnhook(void)
 {
+    DWORD dwSlot;
+
+    if (g_pState)
+        g_pState->qwHwnd = 0;
     UnhookWindowsHookEx(g_hShellHook);
     UnhookWindowsHookEx(g_hCbtHook);
     g_hShellHook = g_hCbtHook = NULL;
+    for (dwSlot = 0; dwSlot < KBS_MAX_ACTIVATIONS; ++dwSlot)
+        RemoveActivationHook(dwSlot);
+}
+
+void KbsSetEventMask(DWORD dwEventMask)
+{
+    g_dwEventMask = dwEventMask;
+    if (g_pState)
+        g_pState->dwEventMask = dwEventMask;
+}
+
+void KbsGetCounters(PKBS_HOOK_COUNTERS pCounters)
+{
+    if (g_pState)
+        *pCounters = g_pState->Counters;
+    else
+        pCounters->cPosted = pCounters->cPostFailed = pCounters->cProcesses = 0;
 }
 
 BOOL WINAPI
 DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 {
-    HWND hwnd;
-
     switch (fdwReason)
     {
         case DLL_PROCESS_ATTACH:
             g_hinstDLL = hinstDLL;
+            DisableThreadLibraryCalls(hinstDLL);
+            break;
+        case DLL_PROCESS_DETACH:
+            if (g_bCounted)
+                InterlockedDecrement(&g_pState->Counters.cProcesses);
+            /* On the exit of the process, the system cleans up */
+            if (lpvReserved || !g_pState)
+                break;
+            UnmapViewOfFile(g_pState);
+            CloseHandle(g_hStateMapping);
             break;
     }
 
@@ -0,0 +1,102 @@
+/*
+ * PROJECT:         Keyboard Layout Switcher
+ * FILE:            base/applications/kbswitch/kbssec.h
+ * PURPOSE:         Securing the named objects shared with the other processes
+ * PROGRAMMERS:     Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+
+/*
+ * kbswitch shares named objects with the other processes: the control pipe,
+ * the snapshot and the state of kbsdll. Any process could create one of those
+ * names first and pose as kbswitch. So they are created with a DACL that only
+ * grants the user of kbswitch, and an object that already exists is only
+ * trusted if it is owned by that user, by the administrators or by the system;
+ * the others cannot create objects owned by them.
+ *
+ * Usage:
+ *     KBS_USER_SECURITY Security;
+ *     hObject = CreateXxx(KbsInitUserSecurity(&Security), ...);
+ *     if (GetLastError() == ERROR_ALREADY_EXISTS && !KbsIsTrustedOwner(hObject))
+ *         ...refuse it...
+ *
+ * The handles must have READ_CONTROL access for KbsIsTrustedOwner.
+ */
+
+#pragma once
+
+#include <windows.h>
+
+typedef struct tagKBS_USER_SECURITY
+{
+    SECURITY_ATTRIBUTES sa;
+    SECURITY_DESCRIPTOR sd;
+    DWORD_PTR Acl[(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + SECURITY_MAX_SID_SIZE) /
+                  sizeof(DWORD_PTR) + 1];
+    DWORD_PTR User[(sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE) / sizeof(DWORD_PTR) + 1];
+} KBS_USER_SECURITY, *PKBS_USER_SECURITY;
+
+/* Gets the TOKEN_USER of this process */
+static BOOL KbsGetTokenUser(DWORD_PTR *pUser, DWORD cbUser)
+{
+    HANDLE hToken;
+    DWORD cbNeeded;
+    BOOL bOK;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken))
+        return FALSE;
+
+    bOK = GetTokenInformation(hToken, TokenUser, pUser, cbUser, &cbNeeded);
+    CloseHandle(hToken);
+    return bOK;
+}
+
+/* Returns the attributes to create an object of the user with, or NULL */
+static PSECURITY_ATTRIBUTES KbsInitUserSecurity(PKBS_USER_SECURITY pSecurity)
+{
+    PACL pAcl = (PACL)pSecurity->Acl;
+    PSID pSid;
+
+    if (!KbsGetTokenUser(pSecurity->User, sizeof(pSecurity->User)))
+        return NULL;
+
+    pSid = ((PTOKEN_USER)pSecurity->User)->User.Sid;
+    if (!InitializeAcl(pAcl, sizeof(pSecurity->Acl), ACL_REVISION) ||
+        !AddAccessAllowedAce(pAcl, ACL_REVISION, GENERIC_ALL, pSid) ||
+        !InitializeSecurityDescriptor(&pSecurity->sd, SECURITY_DESCRIPTOR_REVISION) ||
+        !SetSecurityDescriptorDacl(&pSecurity->sd, TRUE, pAcl, FALSE))
+    {
+        return NULL;
+    }
+
+    pSecurity->sa.nLength = sizeof(pSecurity->sa);
+    pSecurity->sa.lpSecurityDescriptor = &pSecurity->sd;
+    pSecurity->sa.bInheritHandle = FALSE;
+    return &pSecurity->sa;
+}
+
+/* Whether hObject is owned by the user of this process, the administrators or the system */
+static BOOL KbsIsTrustedOwner(HANDLE hObject)
+{
+    DWORD_PTR SD[(sizeof(SECURITY_DESCRIPTOR) + SECURITY_MAX_SID_SIZE) / sizeof(DWORD_PTR) + 8];
+    DWORD_PTR User[(sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE) / sizeof(DWORD_PTR) + 1];
+    DWORD cbNeeded;
+    PSID pOwner = NULL;
+    BOOL bDefaulted;
+
+    if (!GetKernelObjectSecurity(hObject, OWNER_SECURITY_INFORMATION, (PSECURITY_DESCRIPTOR)SD,
+                                 sizeof(SD), &cbNeeded) ||
+        !GetSecurityDescriptorOwner((PSECURITY_DESCRIPTOR)SD, &pOwner, &bDefaulted) ||
+        pOwner == NULL)
+    {
+        return FALSE;
+    }
+
+    if (IsWellKnownSid(pOwner, WinLocalSystemSid) ||
+        IsWellKnownSid(pOwner, WinBuiltinAdministratorsSid))
+    {
+        return TRUE;
+    }
+
+    return KbsGetTokenUser(User, sizeof(User)) &&
+           EqualSid(pOwner, ((PTOKEN_USER)User)->User.Sid);
+}
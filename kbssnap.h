@@ -0,0 +1,232 @@
+/*
+ * PROJECT:         Keyboard Layout Switcher
+ * FILE:            base/applications/kbswitch/kbssnap.h
+ * PURPOSE:         Reading the current layout published by kbswitch
+ * PROGRAMMERS:     Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+
+/*
+ * kbswitch publishes the current layout in a shared memory block of its session.
+ * The block is guarded by a sequence lock: the writer makes the sequence odd,
+ * updates the data and makes it even again. Readers copy the data between two
+ * reads of the sequence and retry if they differ or are odd, so any number of
+ * them can read without locks or messages. A reader that keeps finding the
+ * sequence odd checks that the writer is still alive, so a kbswitch that died
+ * in the middle of a write ends the read instead of hanging it; the next
+ * kbswitch takes the block over. A block that is not owned by the user, the
+ * administrators or the system is not kbswitch's, and is not read.
+ *
+ * Each publication sets one of two manual-reset events and resets the other,
+ * by the parity of the publication count. A reader that has seen a sequence
+ * waits for the event of the next publication.
+ *
+ * Usage:
+ *     KBS_SNAPSHOT_READER Reader;
+ *     KBS_SNAPSHOT_DATA Data;
+ *     DWORD dwSequence;
+ *     if (KbsSnapOpen(&Reader))
+ *     {
+ *         while (KbsSnapRead(&Reader, &Data, &dwSequence))
+ *         {
+ *             ...
+ *             KbsSnapWait(&Reader, dwSequence, INFINITE);
+ *         }
+ *         KbsSnapClose(&Reader);
+ *     }
+ */
+
+#pragma once
+
+#include <windows.h>
+#include "kbssec.h"
+
+#define KBS_SNAPSHOT_NAME           TEXT("Local\\kbswitch.Snapshot.1")
+#define KBS_SNAPSHOT_EVENT_0        TEXT("Local\\kbswitch.SnapshotChanged.1.0")
+#define KBS_SNAPSHOT_EVENT_1        TEXT("Local\\kbswitch.SnapshotChanged.1.1")
+#define KBS_SNAPSHOT_MAGIC          0x50414E53 /* "SNAP" */
+#define KBS_SNAPSHOT_VERSION        1
+
+/* Spins of KbsSnapRead before it yields to the writer */
+#define KBS_SNAPSHOT_SPINS          64
+/* Yields on one odd sequence before KbsSnapRead looks for the writer */
+#define KBS_SNAPSHOT_STALLS         16
+
+typedef struct tagKBS_SNAPSHOT_DATA
+{
+    DWORD64 qwHKL;          /* Zero if kbswitch has exited */
+    DWORD64 qwForeground;   /* The HWND of the window the layout belongs to */
+    DWORD dwKLID;
+    DWORD dwProcessId;      /* kbswitch's */
+    WCHAR szBadge[4];       /* "EN", "FR", ... as shown in the tray */
+    WCHAR szText[64];       /* The tooltip of the tray icon */
+} KBS_SNAPSHOT_DATA, *PKBS_SNAPSHOT_DATA;
+
+typedef struct tagKBS_SNAPSHOT
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbSize;           /* sizeof(KBS_SNAPSHOT) */
+    volatile LONG lSequence; /* Odd while the data is being written */
+    KBS_SNAPSHOT_DATA Data;
+} KBS_SNAPSHOT, *PKBS_SNAPSHOT;
+
+/* The event of the publication that makes the sequence dwSequence */
+#define KBS_SNAPSHOT_EVENT_INDEX(dwSequence) (((dwSequence) / 2) & 1)
+
+typedef struct tagKBS_SNAPSHOT_READER
+{
+    HANDLE hMapping;
+    const KBS_SNAPSHOT *pSnapshot;
+    HANDLE ahEvents[2];
+} KBS_SNAPSHOT_READER, *PKBS_SNAPSHOT_READER;
+
+static void KbsSnapClose(PKBS_SNAPSHOT_READER pReader)
+{
+    if (pReader->pSnapshot)
+        UnmapViewOfFile((LPCVOID)pReader->pSnapshot);
+    if (pReader->hMapping)
+        CloseHandle(pReader->hMapping);
+    if (pReader->ahEvents[0])
+        CloseHandle(pReader->ahEvents[0]);
+    if (pReader->ahEvents[1])
+        CloseHandle(pReader->ahEvents[1]);
+    ZeroMemory(pReader, sizeof(*pReader));
+}
+
+/* Fails if kbswitch is not running in this session */
+static BOOL KbsSnapOpen(PKBS_SNAPSHOT_READER pReader)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+
+    ZeroMemory(pReader, sizeof(*pReader));
+
+    pReader->hMapping = OpenFileMapping(FILE_MAP_READ | READ_CONTROL, FALSE, KBS_SNAPSHOT_NAME);
+    if (pReader->hMapping == NULL)
+        return FALSE;
+
+    if (!KbsIsTrustedOwner(pReader->hMapping))
+    {
+        KbsSnapClose(pReader);
+        return FALSE;
+    }
+
+    pReader->pSnapshot = MapViewOfFile(pReader->hMapping, FILE_MAP_READ, 0, 0, 0);
+    pReader->ahEvents[0] = OpenEvent(SYNCHRONIZE, FALSE, KBS_SNAPSHOT_EVENT_0);
+    pReader->ahEvents[1] = OpenEvent(SYNCHRONIZE, FALSE, KBS_SNAPSHOT_EVENT_1);
+    if (pReader->pSnapshot == NULL || pReader->ahEvents[0] == NULL ||
+        pReader->ahEvents[1] == NULL ||
+        !VirtualQuery(pReader->pSnapshot, &mbi, sizeof(mbi)) ||
+        mbi.RegionSize < sizeof(KBS_SNAPSHOT) ||
+        pReader->pSnapshot->dwMagic != KBS_SNAPSHOT_MAGIC ||
+        pReader->pSnapshot->dwVersion != KBS_SNAPSHOT_VERSION ||
+        pReader->pSnapshot->cbSize < sizeof(KBS_SNAPSHOT))
+    {
+        KbsSnapClose(pReader);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Whether the writer of the sequence lSequence has died in the middle of a
+ * write, leaving the sequence odd for good. A writer that cannot be opened for
+ * the lack of access is taken as alive.
+ */
+static BOOL KbsSnapIsWriterGone(const KBS_SNAPSHOT *pSnapshot, LONG lSequence)
+{
+    DWORD dwProcessId = pSnapshot->Data.dwProcessId;
+    HANDLE hProcess;
+    BOOL bGone;
+
+    if (pSnapshot->lSequence != lSequence)
+        return FALSE;
+    if (dwProcessId == 0)
+        return TRUE;
+
+    hProcess = OpenProcess(SYNCHRONIZE, FALSE, dwProcessId);
+    if (hProcess == NULL)
+        return GetLastError() == ERROR_INVALID_PARAMETER;
+
+    bGone = (WaitForSingleObject(hProcess, 0) == WAIT_OBJECT_0);
+    CloseHandle(hProcess);
+    return bGone;
+}
+
+/*
+ * Copies a consistent snapshot. Returns FALSE if kbswitch has exited, including
+ * when it died while writing.
+ */
+static BOOL
+KbsSnapRead(PKBS_SNAPSHOT_READER pReader, PKBS_SNAPSHOT_DATA pData, PDWORD pdwSequence)
+{
+    const KBS_SNAPSHOT *pSnapshot = pReader->pSnapshot;
+    LONG lBefore, lAfter, lStalled = 0;
+    UINT cSpins = 0, cStalls = 0;
+
+    for (;;)
+    {
+        lBefore = pSnapshot->lSequence;
+        MemoryBarrier();
+        if ((lBefore & 1) == 0)
+        {
+            CopyMemory(pData, (const void *)&pSnapshot->Data, sizeof(*pData));
+            MemoryBarrier();
+            lAfter = pSnapshot->lSequence;
+            if (lBefore == lAfter)
+                break;
+        }
+
+        if (++cSpins < KBS_SNAPSHOT_SPINS)
+            continue;
+        cSpins = 0;
+
+        /* The writer holds an odd sequence only for a copy of the data */
+        if ((lBefore & 1) == 0 || lBefore != lStalled)
+        {
+            lStalled = lBefore;
+            cStalls = 0;
+        }
+        else if (++cStalls >= KBS_SNAPSHOT_STALLS)
+        {
+            if (KbsSnapIsWriterGone(pSnapshot, lBefore))
+            {
+                ZeroMemory(pData, sizeof(*pData));
+                return FALSE;
+            }
+            cStalls = 0;
+            Sleep(1);
+            continue;
+        }
+
+        SwitchToThread();
+    }
+
+    if (pdwSequence)
+        *pdwSequence = (DWORD)lBefore;
+    return pData->qwHKL != 0;
+}
+
+/* Waits until the sequence differs from dwSequence. Returns FALSE on timeout. */
+static BOOL KbsSnapWait(PKBS_SNAPSHOT_READER pReader, DWORD dwSequence, DWORD dwTimeout)
+{
+    HANDLE hEvent = pReader->ahEvents[KBS_SNAPSHOT_EVENT_INDEX(dwSequence + 2)];
+    DWORD dwStart = GetTickCount(), dwElapsed, dwSlice;
+
+    /*
+     * A reader that falls two publications behind may wait on an event that has
+     * already been reset, so the sequence is checked again at every slice.
+     */
+    for (;;)
+    {
+        if ((DWORD)pReader->pSnapshot->lSequence != dwSequence)
+            return TRUE;
+
+        dwElapsed = GetTickCount() - dwStart;
+        if (dwTimeout != INFINITE && dwElapsed >= dwTimeout)
+            return FALSE;
+
+        dwSlice = (dwTimeout == INFINITE) ? 100 : min(dwTimeout - dwElapsed, 100);
+        WaitForSingleObject(hEvent, dwSlice);
+    }
+}
@@ -8,8 +8,18 @@
  */
 
 #include "kbswitch.h"
+#include "kbssnap.h"
+#include "kbssec.h"
+#include <stdlib.h>
+#include <wchar.h>
+#include <ctype.h>
+#include <wctype.h>
 #include <shlobj.h>
 #include <shobjidl.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <psapi.h>
+#include <wtsapi32.h>
 #include "shlwapi_undoc.h"
 
 /*
@@ -21,6 +31,8 @@
  * It needs special care.
  *
  * We use global hook by our kbsdll.dll, to watch the shell and the windows.
+ * The hook also activates the chosen layout on the thread of the target window
+ * (see KbsActivateLayout); WM_INPUTLANGCHANGEREQUEST is the fallback.
  *
  * It might not work correctly on Vista+ because keyboard layout change notification
  * won't be generated in Vista+.
@@ -28,6 +40,9 @@
 
 #define TIMER_ID 999
 #define TIMER_INTERVAL 1000
+#define TIMER_TOLERANCE 250 // How late the polling may be, to share wakeups
+#define ACTIVATE_TIMER_ID 998
+#define ACTIVATE_TIMEOUT 250
 
 #define DEEP_DEBUG
 
@@ -50,21 +65,57 @@ void TRACE(const char *fmt, ...)
 typedef struct tagLAYOUT_ENTRY
 {
     DWORD dwKLID;
-    LPTSTR pszText; // malloc'ed
+    LPTSTR pszText; // malloc'ed, or points into the shared catalog
     DWORD dwVariant;
 } LAYOUT_ENTRY, *PLAYOUT_ENTRY;
 
+/*
+ * GetWindowText sends WM_GETTEXT to the windows of this process, and would wait
+ * for a thread of ours that waits for the caller. The internal text is enough.
+ */
+static INT GetWndText(HWND hwnd, LPTSTR pszText, INT cchText)
+{
+    pszText[0] = 0;
+#ifdef UNICODE
+    return InternalGetWindowText(hwnd, pszText, cchText);
+#else
+    {
+        WCHAR szText[256];
+        INT cch = InternalGetWindowText(hwnd, szText, _countof(szText));
+        if (cch <= 0 || !WideCharToMultiByte(CP_ACP, 0, szText, -1, pszText, cchText,
+                                             NULL, NULL))
+        {
+            pszText[0] = 0;
+            return 0;
+        }
+        pszText[cchText - 1] = 0;
+        return lstrlen(pszText);
+    }
+#endif
+}
+
 void DumpWndInfo(HWND hwnd)
 {
     TCHAR szClass[64], szText[64];
     szClass[0] = szText[0] = 0;
     GetClassName(hwnd, szClass, _countof(szClass));
-    GetWindowText(hwnd, szText, _countof(szText));
+    GetWndText(hwnd, szText, _countof(szText));
     TRACE("hwnd %p: %s: %s\n", hwnd, szClass, szText);
 }
 
 typedef BOOL (*FN_KBS_HOOK)(HWND hwnd);
 typedef void (*FN_KBS_UNHOOK)(void);
+typedef void (*FN_KBS_SET_EVENT_MASK)(DWORD dwEventMask);
+typedef void (*FN_KBS_GET_COUNTERS)(PKBS_HOOK_COUNTERS pCounters);
+typedef DWORD (*FN_KBS_ACTIVATE_LAYOUT)(HWND hwndTarget, HKL hKL);
+typedef BOOL (*FN_KBS_CANCEL_ACTIVATION)(DWORD dwSeq);
+
+// The creation and the focus of the windows are only traced
+#ifdef DEEP_DEBUG
+    #define KBS_EVENT_MASK KBS_EVENT_ALL
+#else
+    #define KBS_EVENT_MASK (KBS_EVENT_LANGUAGE | KBS_EVENT_ACTIVATED | KBS_EVENT_DESTROYED)
+#endif
 
 HINSTANCE g_hInstance = NULL;
 HINSTANCE g_hDLL = NULL;
@@ -76,11 +127,43 @@ HMENU g_hRightPopupMenu = NULL;
 DWORD g_dwCodePageBitField = 0;
 FN_KBS_HOOK g_fnKbsHook = NULL;
 FN_KBS_UNHOOK g_fnKbsUnhook = NULL;
+FN_KBS_GET_COUNTERS g_fnKbsGetCounters = NULL;
+FN_KBS_ACTIVATE_LAYOUT g_fnKbsActivateLayout = NULL;
+FN_KBS_CANCEL_ACTIVATION g_fnKbsCancelActivation = NULL;
+DWORD g_dwActivationSeq = 0; // The pending activation by kbsdll
+HWND g_hwndActivation = NULL;
+HKL g_hKLActivation = NULL;
 HWND g_hwndLastActive = NULL;
-HKL g_hKL = NULL;
+HKL g_hKL = NULL; // The UI thread's
+HKL g_hTrayKL = NULL; // The layout the tray icon shows
+HWND g_hwndMain = NULL;
+HWND g_hwndEvents = NULL; // The window of the event thread, if any
+HANDLE g_hEventThread = NULL;
+HKL g_hEventKL = NULL; // The event thread's
+PVOID volatile g_pHandoffKL = NULL; // From the event thread to the UI thread
+LONG volatile g_lHandoffPosted = FALSE;
+CRITICAL_SECTION g_csCatalog; // Held by the UI thread to change the catalog
+UINT g_cTrainRounds = 0; // "/train [rounds]"; 0 unless training
+BOOL g_bPublishCatalog = FALSE; // "/catalog": refresh the shared catalog and exit
+
+KBS_COUNTERS g_Counters; // Statistics, for diagnostics
 
 // Shell_NotifyIcon's message ID
 #define WM_NOTIFYICONMSG (WM_USER + 248)
+// Posted to handle the queued hook events
+#define WM_DRAINEVENTS   (WM_USER + 249)
+// Posted to continue the startup after the tray icon is shown
+#define WM_STARTUPSTAGE  (WM_USER + 250)
+// Posted by the catalog loader thread
+#define WM_CATALOGLOADED (WM_USER + 251)
+// Sent by the control server thread
+#define WM_CONTROLREQUEST (WM_USER + 252)
+// Posted by the event thread when g_pHandoffKL has been updated
+#define WM_STATECHANGED  (WM_USER + 253)
+// Posted to the event thread to choose lParam (HKL)
+#define WM_CHOOSELAYOUT  (WM_USER + 254)
+// Posted to the event thread when the rules of the policy have changed
+#define WM_RELOADPOLICY  (WM_USER + 255)
 // Character Count of a layout ID like "00000409"
 #define CCH_LAYOUT_ID    8
 // Maximum Character Count of a ULONG in decimal
@@ -92,106 +175,222 @@ HKL g_hKL = NULL;
 // Get hKL's variant
 #define GET_HKL_VARIANT(hKL) (HIWORD(hKL) & 0xFFF)
 
-PLAYOUT_ENTRY g_pLayouts = NULL; // LocalAlloc'ed
-UINT g_cLayouts = 0, g_cLayoutsCapacity = 0;
+/*
+ * Spans, for profiling ("kbsctl trace", or "/trace" from the startup on).
+ *
+ * A span is the time a function or a step took on a thread. While a session
+ * records, each thread appends its spans to a buffer of its own, so that the
+ * threads never contend; while none does, BeginSpan is a load and a branch. A
+ * full buffer drops the spans that follow. KBSCTL_TRACE hands the spans out
+ * when it stops the session, and kbsctl writes them as Chrome trace events.
+ */
+#define MAX_SPAN_THREADS 16
+#define MAX_THREAD_SPANS 2048
 
-static VOID FreeKeyboardLayouts(VOID)
+typedef struct tagSPAN
 {
-    UINT i;
-    for (i = 0; i < g_cLayouts; ++i)
-    {
-        free(g_pLayouts[i].pszText);
-    }
+    LPCSTR pszName; // A literal
+    DWORD dwArg;
+    LONGLONG qwBegin, qwEnd; // QueryPerformanceCounter
+} SPAN, *PSPAN;
 
-    g_cLayouts = g_cLayoutsCapacity = 0;
-    LocalFree(g_pLayouts);
-    g_pLayouts = NULL;
+typedef struct tagSPAN_BUFFER
+{
+    DWORD dwThreadId;
+    DWORD volatile dwSession; // Of the spans
+    LONG volatile cSpans;
+    SPAN Spans[MAX_THREAD_SPANS];
+} SPAN_BUFFER, *PSPAN_BUFFER;
+
+DWORD volatile g_dwSpanSession = 0; // Nonzero while recording
+DWORD g_dwLastSpanSession = 0;
+LARGE_INTEGER g_liSpanSessionStart;
+DWORD g_dwSpanTls = TLS_OUT_OF_INDEXES;
+PSPAN_BUFFER g_apSpanBuffers[MAX_SPAN_THREADS]; // LocalAlloc'ed
+LONG volatile g_cSpanBuffers = 0;
+
+static LONGLONG BeginSpan(VOID)
+{
+    LARGE_INTEGER li;
+
+    if (!g_dwSpanSession)
+        return 0;
+
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
 }
 
-static BOOL LoadKeyboardLayouts(VOID)
+static PSPAN_BUFFER GetSpanBuffer(VOID)
 {
-    HKEY hLayoutsKey, hKey;
-    LONG error;
-    DWORD dwIndex, cb;
-    TCHAR szKeyName[MAX_PATH], szText[MAX_PATH], szDispName[MAX_PATH], szVariant[MAX_PATH];
-    PLAYOUT_ENTRY pLayout;
-    DWORD dwKLID, dwNewCount = 256;
-    HRESULT hr;
+    PSPAN_BUFFER pBuffer = TlsGetValue(g_dwSpanTls);
+    LONG iBuffer;
 
-    FreeKeyboardLayouts();
+    if (pBuffer)
+        return pBuffer;
 
-    g_pLayouts = LocalAlloc(LPTR, dwNewCount * sizeof(LAYOUT_ENTRY));
-    if (g_pLayouts == NULL)
+    if (g_cSpanBuffers >= MAX_SPAN_THREADS)
+        return NULL;
+    iBuffer = InterlockedIncrement(&g_cSpanBuffers) - 1;
+    if (iBuffer >= MAX_SPAN_THREADS)
+        return NULL;
+
+    pBuffer = LocalAlloc(LPTR, sizeof(SPAN_BUFFER));
+    if (pBuffer == NULL)
+        return NULL;
+
+    pBuffer->dwThreadId = GetCurrentThreadId();
+    TlsSetValue(g_dwSpanTls, pBuffer);
+    InterlockedExchangePointer((PVOID volatile *)&g_apSpanBuffers[iBuffer], pBuffer);
+    return pBuffer;
+}
+
+static VOID EndSpan(LPCSTR pszName, DWORD dwArg, LONGLONG qwBegin)
+{
+    DWORD dwSession = g_dwSpanSession;
+    LARGE_INTEGER liEnd;
+    PSPAN_BUFFER pBuffer;
+    PSPAN pSpan;
+
+    if (!qwBegin || !dwSession)
+        return;
+
+    QueryPerformanceCounter(&liEnd);
+
+    pBuffer = GetSpanBuffer();
+    if (pBuffer == NULL)
     {
-        return FALSE;
+        InterlockedIncrement((LONG volatile *)&g_Counters.cSpansDropped);
+        return;
     }
-    g_cLayoutsCapacity = dwNewCount;
 
-    error = RegOpenKey(HKEY_LOCAL_MACHINE,
-                       TEXT("SYSTEM\\CurrentControlSet\\Control\\Keyboard Layouts"),
-                       &hLayoutsKey);
-    if (error != ERROR_SUCCESS)
+    /* Only the owner thread writes its buffer */
+    if (pBuffer->dwSession != dwSession)
     {
-        return FALSE;
+        pBuffer->cSpans = 0;
+        MemoryBarrier();
+        pBuffer->dwSession = dwSession;
     }
 
-    for (dwIndex = 0; dwIndex < 256; ++dwIndex)
+    if (pBuffer->cSpans >= MAX_THREAD_SPANS)
     {
-        szKeyName[0] = UNICODE_NULL;
-        error = RegEnumKey(hLayoutsKey, dwIndex, szKeyName, _countof(szKeyName));
-        if (error != ERROR_SUCCESS)
-            break;
+        InterlockedIncrement((LONG volatile *)&g_Counters.cSpansDropped);
+        return;
+    }
 
-        error = RegOpenKey(hLayoutsKey, szKeyName, &hKey);
-        if (error != ERROR_SUCCESS)
-            break;
+    pSpan = &pBuffer->Spans[pBuffer->cSpans];
+    pSpan->pszName = pszName;
+    pSpan->dwArg = dwArg;
+    pSpan->qwBegin = qwBegin;
+    pSpan->qwEnd = liEnd.QuadPart;
+    InterlockedIncrement(&pBuffer->cSpans); // Publishes the span
+}
+
+static VOID StartSpanSession(VOID)
+{
+    if (g_dwSpanTls == TLS_OUT_OF_INDEXES)
+    {
+        g_dwSpanTls = TlsAlloc();
+        if (g_dwSpanTls == TLS_OUT_OF_INDEXES)
+            return;
+    }
+
+    QueryPerformanceCounter(&g_liSpanSessionStart);
+    if (++g_dwLastSpanSession == 0)
+        ++g_dwLastSpanSession;
+    InterlockedExchange((LONG volatile *)&g_dwSpanSession, g_dwLastSpanSession);
+}
+
+// Stops the session. Copies up to cMax spans to pSpans and returns their count,
+// or the count of all the spans if pSpans is NULL.
+static UINT ExportSpans(PKBSCTL_SPAN pSpans, UINT cMax)
+{
+    LARGE_INTEGER liFreq;
+    PSPAN_BUFFER pBuffer;
+    PSPAN pSpan;
+    UINT iBuffer, iSpan, cSpans, cExported = 0;
+
+    InterlockedExchange((LONG volatile *)&g_dwSpanSession, 0);
+    QueryPerformanceFrequency(&liFreq);
+
+    for (iBuffer = 0; iBuffer < MAX_SPAN_THREADS; ++iBuffer)
+    {
+        pBuffer = g_apSpanBuffers[iBuffer];
+        if (pBuffer == NULL || pBuffer->dwSession != g_dwLastSpanSession)
+            continue;
 
-        if (g_cLayoutsCapacity < g_cLayouts + 1)
+        cSpans = pBuffer->cSpans;
+        if (pSpans == NULL)
         {
-            DWORD dwNewCount = g_cLayouts + 16;
-            cb = dwNewCount * sizeof(LAYOUT_ENTRY);
-            g_pLayouts = LocalReAlloc(g_pLayouts, cb, LPTR);
-            if (g_pLayouts == NULL)
-                break;
+            cExported += cSpans;
+            continue;
+        }
 
-            g_cLayoutsCapacity = dwNewCount;
+        for (iSpan = 0; iSpan < cSpans && cExported < cMax; ++iSpan, ++cExported)
+        {
+            pSpan = &pBuffer->Spans[iSpan];
+            pSpans[cExported].qwBegin =
+                (pSpan->qwBegin - g_liSpanSessionStart.QuadPart) * 1000000 / liFreq.QuadPart;
+            pSpans[cExported].dwDuration =
+                (DWORD)((pSpan->qwEnd - pSpan->qwBegin) * 1000000 / liFreq.QuadPart);
+            pSpans[cExported].dwThreadId = pBuffer->dwThreadId;
+            pSpans[cExported].dwArg = pSpan->dwArg;
+            StringCchCopyA(pSpans[cExported].szName, _countof(pSpans[cExported].szName),
+                           pSpan->pszName);
         }
+    }
 
-        pLayout = &g_pLayouts[g_cLayouts];
+    return cExported;
+}
 
-        // "Layout Text"
-        szText[0] = 0;
-        cb = sizeof(szText);
-        error = RegQueryValueEx(hKey, TEXT("Layout Text"), NULL, NULL, (LPBYTE)szText, &cb);
-        if (error == ERROR_SUCCESS && cb > sizeof(WCHAR))
-        {
-            // "Layout Id"
-            pLayout->dwVariant = 0;
-            cb = sizeof(szVariant);
-            error = RegQueryValueEx(hKey, TEXT("Layout Id"), NULL, NULL, (LPBYTE)szVariant, &cb);
-            if (error == ERROR_SUCCESS && cb > sizeof(WCHAR))
-            {
-                pLayout->dwVariant = _tcstoul(szVariant, NULL, 16);
-            }
+static VOID FreeSpanBuffers(VOID)
+{
+    UINT iBuffer;
 
-            pLayout->pszText = _tcsdup(szText);
+    g_dwSpanSession = 0;
+    for (iBuffer = 0; iBuffer < MAX_SPAN_THREADS; ++iBuffer)
+    {
+        LocalFree(g_apSpanBuffers[iBuffer]);
+        g_apSpanBuffers[iBuffer] = NULL;
+    }
+    g_cSpanBuffers = 0;
 
-            // dwKLID
-            pLayout->dwKLID = dwKLID = _tcstoul(szKeyName, NULL, 16);
+    if (g_dwSpanTls != TLS_OUT_OF_INDEXES)
+    {
+        TlsFree(g_dwSpanTls);
+        g_dwSpanTls = TLS_OUT_OF_INDEXES;
+    }
+}
 
-            g_cLayouts++;
-        }
+PLAYOUT_ENTRY g_pLayouts = NULL; // LocalAlloc'ed
+UINT g_cLayouts = 0, g_cLayoutsCapacity = 0;
+TCHAR g_szLayoutsRegFile[MAX_PATH] = TEXT(""); // "/reg <file>"
+BOOL g_bCatalogReady = FALSE; // Has the loader thread finished?
+BOOL g_bLazyCatalog = FALSE; // The "LazyCatalog" setting
+BOOL g_bCatalogFull = FALSE; // Has the whole catalog been loaded?
+HKL g_ahKLMisses[32]; // HKLs not in the catalog, for the lazy mode
+UINT g_cKLMisses = 0, g_iNextKLMiss = 0;
+HANDLE g_hCatalogThread = NULL;
+BOOL g_bLayoutsShared = FALSE; // Do the entries point into the shared catalog?
 
-        RegCloseKey(hKey);
+static VOID FreeKeyboardLayouts(VOID)
+{
+    UINT i;
+    if (!g_bLayoutsShared)
+    {
+        for (i = 0; i < g_cLayouts; ++i)
+        {
+            free(g_pLayouts[i].pszText);
+        }
     }
 
-    RegCloseKey(hLayoutsKey);
-    return g_cLayouts > 0;
+    g_bLayoutsShared = FALSE;
+    g_cLayouts = g_cLayoutsCapacity = 0;
+    LocalFree(g_pLayouts);
+    g_pLayouts = NULL;
 }
 
-INT FindLayoutEntry(HKL hKL)
+static INT ScanLayoutEntries(HKL hKL)
 {
-    PLAYOUT_ENTRY pEntry;
     UINT i;
 
     if (IS_IME_HKL(hKL))
@@ -230,649 +429,4818 @@ INT FindLayoutEntry(HKL hKL)
     return -1;
 }
 
-static HBITMAP BitmapFromIcon(HICON hIcon)
+static BOOL AppendLayoutEntry(DWORD dwKLID, LPCTSTR pszText, DWORD dwVariant)
 {
-    HDC hdcScreen = GetDC(NULL);
-    HDC hdc = CreateCompatibleDC(hdcScreen);
-    INT cxIcon = GetSystemMetrics(SM_CXSMICON);
-    INT cyIcon = GetSystemMetrics(SM_CYSMICON);
-    HBITMAP hbm = CreateCompatibleBitmap(hdcScreen, cxIcon, cyIcon);
-    HGDIOBJ hbmOld;
+    PLAYOUT_ENTRY pLayouts, pLayout;
+    DWORD dwNewCount;
 
-    if (hbm != NULL)
+    if (g_cLayoutsCapacity < g_cLayouts + 1)
     {
-        hbmOld = SelectObject(hdc, hbm);
-        DrawIconEx(hdc, 0, 0, hIcon, cxIcon, cyIcon, 0, GetSysColorBrush(COLOR_MENU), DI_NORMAL);
-        SelectObject(hdc, hbmOld);
+        /* Grow geometrically; a .reg export can hold thousands of layouts */
+        dwNewCount = max(g_cLayoutsCapacity * 2, g_cLayouts + 16);
+        if (g_pLayouts == NULL)
+            pLayouts = LocalAlloc(LPTR, dwNewCount * sizeof(LAYOUT_ENTRY));
+        else
+            pLayouts = LocalReAlloc(g_pLayouts, dwNewCount * sizeof(LAYOUT_ENTRY),
+                                    LMEM_MOVEABLE | LMEM_ZEROINIT);
+        if (pLayouts == NULL)
+            return FALSE;
+
+        g_pLayouts = pLayouts;
+        g_cLayoutsCapacity = dwNewCount;
     }
 
-    DeleteDC(hdc);
-    ReleaseDC(NULL, hdcScreen);
-    return hbm;
+    pLayout = &g_pLayouts[g_cLayouts];
+    pLayout->pszText = _tcsdup(pszText);
+    if (pLayout->pszText == NULL)
+        return FALSE;
+
+    pLayout->dwKLID = dwKLID;
+    pLayout->dwVariant = dwVariant;
+    g_cLayouts++;
+    return TRUE;
 }
 
+#define KEYBOARD_LAYOUTS_KEY TEXT("SYSTEM\\CurrentControlSet\\Control\\Keyboard Layouts")
+
+// Reads "Layout Text" and "Layout Id" of a subkey. Safe to call from any thread.
 static BOOL
-GetSystemLibraryPath(LPTSTR szPath, SIZE_T cchPath, LPCTSTR FileName)
+ReadLayoutKeyValues(HKEY hLayoutsKey, LPCTSTR pszKeyName, LPTSTR pszText, DWORD cchText,
+                    PDWORD pdwVariant)
 {
-    if (!GetSystemDirectory(szPath, cchPath))
+    HKEY hKey;
+    LONG error;
+    DWORD cb;
+    TCHAR szVariant[MAX_PATH];
+    BOOL bRead = FALSE;
+
+    error = RegOpenKey(hLayoutsKey, pszKeyName, &hKey);
+    if (error != ERROR_SUCCESS)
         return FALSE;
 
-    StringCchCat(szPath, cchPath, TEXT("\\"));
-    StringCchCat(szPath, cchPath, FileName);
-    return TRUE;
+    // "Layout Text"
+    pszText[0] = 0;
+    cb = cchText * sizeof(TCHAR);
+    error = RegQueryValueEx(hKey, TEXT("Layout Text"), NULL, NULL, (LPBYTE)pszText, &cb);
+    if (error == ERROR_SUCCESS && cb > sizeof(WCHAR))
+    {
+        // "Layout Id"
+        *pdwVariant = 0;
+        cb = sizeof(szVariant);
+        error = RegQueryValueEx(hKey, TEXT("Layout Id"), NULL, NULL, (LPBYTE)szVariant, &cb);
+        if (error == ERROR_SUCCESS && cb > sizeof(WCHAR))
+        {
+            *pdwVariant = _tcstoul(szVariant, NULL, 16);
+        }
+        bRead = TRUE;
+    }
+
+    RegCloseKey(hKey);
+    return bRead;
 }
 
-static HICON
-CreateTrayIcon(HKL hKL, LPCTSTR szImeFile OPTIONAL)
+// Appends the entry of a subkey. If pdwVariant is given, only that variant is accepted.
+static BOOL ReadLayoutKey(HKEY hLayoutsKey, LPCTSTR pszKeyName, const DWORD *pdwVariant)
 {
-    LANGID LangID;
-    TCHAR szBuf[4];
-    HDC hdcScreen, hdc;
-    HBITMAP hbmColor, hbmMono, hBmpOld;
-    HFONT hFont, hFontOld;
-    LOGFONT lf;
-    RECT rect;
-    ICONINFO IconInfo;
-    HICON hIcon;
-    INT cxIcon = GetSystemMetrics(SM_CXSMICON);
-    INT cyIcon = GetSystemMetrics(SM_CYSMICON);
-    TCHAR szPath[MAX_PATH];
+    DWORD dwVariant;
+    TCHAR szText[MAX_PATH];
 
-    if (szImeFile && szImeFile[0])
+    if (!ReadLayoutKeyValues(hLayoutsKey, pszKeyName, szText, _countof(szText), &dwVariant))
+        return FALSE;
+
+    if (pdwVariant && *pdwVariant != dwVariant)
+        return FALSE;
+
+    return AppendLayoutEntry(_tcstoul(pszKeyName, NULL, 16), szText, dwVariant);
+}
+
+/*
+ * Parallel loading of the catalog.
+ *
+ * Enumerating the subkeys is one cheap call each, but every entry then takes an
+ * open and two value queries, each of which can block on a slow or roaming
+ * profile. The subkey names are enumerated first; then the workers read a
+ * contiguous range of them each into their own arena. The arenas are merged in
+ * worker order, so the catalog is the same as the one read serially.
+ */
+#define MAX_LAYOUT_KEYS         256
+#define MAX_CATALOG_THREADS     8
+#define DEFAULT_CATALOG_THREADS 4
+#define MIN_KEYS_PER_THREAD     16
+
+typedef struct tagCATALOG_WORKER
+{
+    HKEY hLayoutsKey;
+    TCHAR (*pszKeyNames)[CCH_LAYOUT_ID + 1];
+    UINT iFirst, iEnd;          // The range of pszKeyNames to read
+    PLAYOUT_ENTRY pEntries;     // The arena; pszText's are malloc'ed
+    UINT cEntries;
+    HANDLE hThread;
+} CATALOG_WORKER, *PCATALOG_WORKER;
+
+UINT g_cCatalogThreads = DEFAULT_CATALOG_THREADS; // The "CatalogThreads" setting
+DWORD g_dwLayoutCacheTTL = 5000; // The "LayoutCacheTTL" setting
+
+static DWORD WINAPI CatalogWorkerProc(LPVOID lpParameter)
+{
+    PCATALOG_WORKER pWorker = lpParameter;
+    PLAYOUT_ENTRY pEntry;
+    TCHAR szText[MAX_PATH];
+    DWORD dwVariant;
+    UINT i;
+
+    for (i = pWorker->iFirst; i < pWorker->iEnd; ++i)
     {
-        if (GetSystemLibraryPath(szPath, _countof(szPath), szImeFile))
+        if (!ReadLayoutKeyValues(pWorker->hLayoutsKey, pWorker->pszKeyNames[i],
+                                 szText, _countof(szText), &dwVariant))
         {
-            ExtractIconEx(szPath, 0, NULL, &hIcon, 1);
-            if (hIcon)
-                return hIcon;
+            continue;
         }
+
+        pEntry = &pWorker->pEntries[pWorker->cEntries];
+        pEntry->pszText = _tcsdup(szText);
+        if (pEntry->pszText == NULL)
+            break;
+
+        pEntry->dwKLID = _tcstoul(pWorker->pszKeyNames[i], NULL, 16);
+        pEntry->dwVariant = dwVariant;
+        pWorker->cEntries++;
     }
 
-    /* Getting "EN", "FR", etc. from English, French, ... */
-    LangID = LOWORD(hKL);
-    if (GetLocaleInfo(LangID,
-                      LOCALE_SABBREVLANGNAME | LOCALE_NOUSEROVERRIDE,
-                      szBuf,
-                      _countof(szBuf)) == 0)
+    return 0;
+}
+
+static BOOL LoadKeyboardLayoutsFromRegistry(VOID)
+{
+    HKEY hLayoutsKey;
+    LONG error;
+    DWORD dwIndex;
+    TCHAR szKeyName[MAX_PATH];
+    TCHAR (*pszKeyNames)[CCH_LAYOUT_ID + 1];
+    CATALOG_WORKER aWorkers[MAX_CATALOG_THREADS];
+    PLAYOUT_ENTRY pArena;
+    UINT cKeys = 0, cWorkers, iWorker, i;
+
+    error = RegOpenKey(HKEY_LOCAL_MACHINE, KEYBOARD_LAYOUTS_KEY, &hLayoutsKey);
+    if (error != ERROR_SUCCESS)
     {
-        szBuf[0] = szBuf[1] = _T('?');
+        return FALSE;
     }
-    szBuf[2] = 0; /* Truncate the identifier to two characters: "ENG" --> "EN" etc. */
-
-    /* Create hdc, hbmColor and hbmMono */
-    hdcScreen = GetDC(NULL);
-    hdc = CreateCompatibleDC(hdcScreen);
-    hbmColor = CreateCompatibleBitmap(hdcScreen, cxIcon, cyIcon);
-    ReleaseDC(NULL, hdcScreen);
-    hbmMono = CreateBitmap(cxIcon, cyIcon, 1, 1, NULL);
 
-    /* Checking NULL */
-    if (!hdc || !hbmColor || !hbmMono)
+    pszKeyNames = LocalAlloc(LPTR, MAX_LAYOUT_KEYS * sizeof(*pszKeyNames));
+    pArena = LocalAlloc(LPTR, MAX_LAYOUT_KEYS * sizeof(LAYOUT_ENTRY));
+    if (pszKeyNames == NULL || pArena == NULL)
     {
-        if (hbmMono)
-            DeleteObject(hbmMono);
-        if (hbmColor)
-            DeleteObject(hbmColor);
-        if (hdc)
-            DeleteDC(hdc);
-        return NULL;
+        LocalFree(pszKeyNames);
+        LocalFree(pArena);
+        RegCloseKey(hLayoutsKey);
+        return FALSE;
     }
 
-    /* Create a font */
-    hFont = NULL;
-    if (SystemParametersInfo(SPI_GETICONTITLELOGFONT, sizeof(lf), &lf, 0))
+    for (dwIndex = 0; dwIndex < MAX_LAYOUT_KEYS; ++dwIndex)
     {
-        /* Override the current size with something manageable */
-        lf.lfHeight = -11;
-        lf.lfWidth = 0;
-        hFont = CreateFontIndirect(&lf);
+        szKeyName[0] = UNICODE_NULL;
+        error = RegEnumKey(hLayoutsKey, dwIndex, szKeyName, _countof(szKeyName));
+        if (error != ERROR_SUCCESS)
+            break;
+
+        if (lstrlen(szKeyName) > CCH_LAYOUT_ID)
+            continue;
+        StringCchCopy(pszKeyNames[cKeys], _countof(pszKeyNames[cKeys]), szKeyName);
+        ++cKeys;
     }
-    if (!hFont)
-        hFont = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
 
-    SetRect(&rect, 0, 0, cxIcon, cyIcon);
+    cWorkers = min(g_cCatalogThreads, MAX_CATALOG_THREADS);
+    cWorkers = max(min(cWorkers, cKeys / MIN_KEYS_PER_THREAD), 1);
 
-    /* Draw hbmColor */
-    hBmpOld = SelectObject(hdc, hbmColor);
-    SetDCBrushColor(hdc, GetSysColor(COLOR_HIGHLIGHT));
-    FillRect(hdc, &rect, (HBRUSH)GetStockObject(DC_BRUSH));
-    hFontOld = SelectObject(hdc, hFont);
-    SetTextColor(hdc, GetSysColor(COLOR_HIGHLIGHTTEXT));
-    SetBkMode(hdc, TRANSPARENT);
-    DrawText(hdc, szBuf, 2, &rect, DT_SINGLELINE | DT_CENTER | DT_VCENTER);
-    SelectObject(hdc, hFontOld);
+    /* The arenas are the disjoint slices of pArena */
+    for (iWorker = 0; iWorker < cWorkers; ++iWorker)
+    {
+        PCATALOG_WORKER pWorker = &aWorkers[iWorker];
+        pWorker->hLayoutsKey = hLayoutsKey;
+        pWorker->pszKeyNames = pszKeyNames;
+        pWorker->iFirst = cKeys * iWorker / cWorkers;
+        pWorker->iEnd = cKeys * (iWorker + 1) / cWorkers;
+        pWorker->pEntries = &pArena[pWorker->iFirst];
+        pWorker->cEntries = 0;
+        pWorker->hThread = NULL;
+        if (iWorker > 0)
+            pWorker->hThread = CreateThread(NULL, 0, CatalogWorkerProc, pWorker, 0, NULL);
+    }
 
-    /* Fill hbmMono with black */
-    SelectObject(hdc, hbmMono);
-    PatBlt(hdc, 0, 0, cxIcon, cyIcon, BLACKNESS);
-    SelectObject(hdc, hBmpOld);
+    /* The calling thread is the first worker, and the fallback of the others */
+    CatalogWorkerProc(&aWorkers[0]);
+    for (iWorker = 1; iWorker < cWorkers; ++iWorker)
+    {
+        if (aWorkers[iWorker].hThread == NULL)
+        {
+            CatalogWorkerProc(&aWorkers[iWorker]);
+            continue;
+        }
+        WaitForSingleObject(aWorkers[iWorker].hThread, INFINITE);
+        CloseHandle(aWorkers[iWorker].hThread);
+    }
 
-    /* Create an icon from hbmColor and hbmMono */
-    IconInfo.fIcon = TRUE;
-    IconInfo.xHotspot = IconInfo.yHotspot = 0;
-    IconInfo.hbmColor = hbmColor;
-    IconInfo.hbmMask = hbmMono;
-    hIcon = CreateIconIndirect(&IconInfo);
+    /* Merge in worker order; the strings are moved, not copied */
+    for (iWorker = 0; iWorker < cWorkers; ++iWorker)
+    {
+        PCATALOG_WORKER pWorker = &aWorkers[iWorker];
+        for (i = 0; i < pWorker->cEntries; ++i)
+        {
+            if (g_cLayouts < g_cLayoutsCapacity)
+                g_pLayouts[g_cLayouts++] = pWorker->pEntries[i];
+            else
+                free(pWorker->pEntries[i].pszText);
+        }
+    }
 
-    /* Clean up */
-    DeleteObject(hFont);
-    DeleteObject(hbmMono);
-    DeleteObject(hbmColor);
-    DeleteDC(hdc);
+    TRACE("Catalog: %u keys read by %u threads\n", cKeys, cWorkers);
 
-    return hIcon;
+    LocalFree(pArena);
+    LocalFree(pszKeyNames);
+    RegCloseKey(hLayoutsKey);
+    return g_cLayouts > 0;
 }
 
-HKL ShowKeyboardMenu(HWND hwnd, HKL hCheckKL, POINT pt)
+/*
+ * Loading the catalog from a regedit export (*.reg) instead of the live HKLM hive.
+ *
+ * The file is mapped read-only and scanned in place. Lines and values are only
+ * referred to by offsets into the view; nothing but the final "Layout Text" is
+ * copied. Both the REGEDIT4 (UTF-8/ANSI) and the regedit 5.00 (UTF-16LE) formats
+ * are accepted. In an ANSI file of a DBCS code page, the trail byte of a double
+ * byte character can be 0x5C, so the scanning steps over double byte characters
+ * whole instead of taking such a byte for a backslash.
+ */
+typedef struct tagREG_FILE_TEXT
 {
-    HKL hKL, ahKLs[256];
-    UINT iKL, cKLs;
-    HMENU hMenu = CreatePopupMenu();
-    MENUITEMINFO mii = { sizeof(mii) };
-    TCHAR szText[MAX_PATH], szImeFile[MAX_PATH];
-    PLAYOUT_ENTRY pEntry;
-    INT iEntry;
-    HICON hIcon;
+    const BYTE *pb;     // The mapped view
+    SIZE_T cch;         // Count of code units in the view
+    BOOL bWide;         // UTF-16LE or not
+    UINT uCodePage;     // The code page if not bWide
+    BOOL bDBCS;         // uCodePage has double byte characters
+} REG_FILE_TEXT, *PREG_FILE_TEXT;
 
-    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
-    for (iKL = 0; iKL < cKLs; ++iKL)
+#define REG_FILE_CHAR(pText, ich) \
+    ((pText)->bWide ? ((const WCHAR *)(pText)->pb)[ich] : (WCHAR)(pText)->pb[ich])
+
+// Is the byte at ich the lead byte of a double byte character?
+#define REG_FILE_IS_LEAD_BYTE(pText, ich) \
+    ((pText)->bDBCS && IsDBCSLeadByteEx((pText)->uCodePage, (pText)->pb[ich]))
+
+static SIZE_T RegFileFindEOL(const REG_FILE_TEXT *pText, SIZE_T ich)
+{
+    const void *pFound;
+
+    /* memchr and wmemchr are vectorized by the CRT */
+    if (pText->bWide)
+        pFound = wmemchr((const WCHAR *)pText->pb + ich, L'\n', pText->cch - ich);
+    else
+        pFound = memchr(pText->pb + ich, '\n', pText->cch - ich);
+
+    if (pFound == NULL)
+        return pText->cch;
+
+    if (pText->bWide)
+        return (const WCHAR *)pFound - (const WCHAR *)pText->pb;
+    return (const BYTE *)pFound - pText->pb;
+}
+
+// Returns the index of the closing quote, or ichLast if the string is unterminated.
+static SIZE_T RegFileSkipString(const REG_FILE_TEXT *pText, SIZE_T ich, SIZE_T ichLast)
+{
+    WCHAR ch;
+
+    for (; ich < ichLast; ++ich)
     {
-        hKL = ahKLs[iKL];
+        ch = REG_FILE_CHAR(pText, ich);
+        if (ch == L'\\' || REG_FILE_IS_LEAD_BYTE(pText, ich))
+            ++ich;
+        else if (ch == L'"')
+            break;
+    }
 
-        iEntry = FindLayoutEntry(hKL);
-        if (iEntry == -1)
-            continue;
+    return min(ich, ichLast);
+}
 
-        pEntry = &g_pLayouts[iEntry];
+// Compares a range of the file with an ASCII string, case-insensitively.
+static BOOL RegFileMatch(const REG_FILE_TEXT *pText, SIZE_T ich, SIZE_T cch, LPCSTR psz)
+{
+    SIZE_T i;
 
-        szText[0] = 0;
-        szImeFile[0] = 0;
+    for (i = 0; i < cch; ++i)
+    {
+        WCHAR ch = REG_FILE_CHAR(pText, ich + i);
+        if (psz[i] == 0 || towlower(ch) != (WCHAR)tolower((BYTE)psz[i]))
+            return FALSE;
+    }
 
-        if (IS_IME_HKL(hKL))
-        {
-            ImmGetDescription(hKL, szText, _countof(szText));
-            ImmGetIMEFileName(hKL, szImeFile, _countof(szImeFile));
-        }
+    return psz[i] == 0;
+}
+
+static BOOL RegFileParseKLID(const REG_FILE_TEXT *pText, SIZE_T ich, SIZE_T cch, LPDWORD pdwKLID)
+{
+    DWORD dwKLID = 0;
+    SIZE_T i;
+
+    if (cch != CCH_LAYOUT_ID)
+        return FALSE;
+
+    for (i = 0; i < cch; ++i)
+    {
+        WCHAR ch = REG_FILE_CHAR(pText, ich + i);
+        if (L'0' <= ch && ch <= L'9')
+            dwKLID = (dwKLID << 4) | (ch - L'0');
+        else if (L'A' <= ch && ch <= L'F')
+            dwKLID = (dwKLID << 4) | (ch - L'A' + 10);
+        else if (L'a' <= ch && ch <= L'f')
+            dwKLID = (dwKLID << 4) | (ch - L'a' + 10);
         else
+            return FALSE;
+    }
+
+    *pdwKLID = dwKLID;
+    return TRUE;
+}
+
+// Is the section line [ich, ichLast) a "...\Keyboard Layouts\XXXXXXXX" key?
+static BOOL
+RegFileParseSection(const REG_FILE_TEXT *pText, SIZE_T ich, SIZE_T ichLast, LPDWORD pdwKLID)
+{
+    static const char s_szParent[] = "\\Keyboard Layouts";
+    const SIZE_T cchParent = _countof(s_szParent) - 1;
+    SIZE_T ichSep;
+
+    if (ichLast - ich < 2 || REG_FILE_CHAR(pText, ichLast - 1) != L']')
+        return FALSE;
+    ++ich;
+    --ichLast;
+
+    /* "[-HKEY_...]" deletes a key */
+    if (ich < ichLast && REG_FILE_CHAR(pText, ich) == L'-')
+        return FALSE;
+
+    for (ichSep = ichLast; ichSep > ich; --ichSep)
+    {
+        if (REG_FILE_CHAR(pText, ichSep - 1) == L'\\')
+            break;
+    }
+    if (ichSep == ich || ichSep - 1 - ich < cchParent)
+        return FALSE;
+    --ichSep;
+
+    return RegFileMatch(pText, ichSep - cchParent, cchParent, s_szParent) &&
+           RegFileParseKLID(pText, ichSep + 1, ichLast - ichSep - 1, pdwKLID);
+}
+
+// Copies and unescapes the contents of a quoted string [ich, ichLast).
+static VOID
+RegFileGetString(const REG_FILE_TEXT *pText, SIZE_T ich, SIZE_T ichLast, LPTSTR pszOut, SIZE_T cchOut)
+{
+    WCHAR szWide[MAX_PATH];
+    CHAR szNarrow[MAX_PATH * 3];
+    SIZE_T cch = 0;
+    WCHAR ch;
+
+    for (; ich < ichLast; ++ich)
+    {
+        ch = REG_FILE_CHAR(pText, ich);
+        if (REG_FILE_IS_LEAD_BYTE(pText, ich) && ich + 1 < ichLast)
         {
-            GetLocaleInfo(LOWORD(hKL), LOCALE_SLANGUAGE, szText, _countof(szText));
-            if (LOWORD(hKL) != HIWORD(hKL))
+            /* Copied whole; its trail byte may be 0x5C */
+            if (cch + 2 < _countof(szNarrow))
             {
-                if (pEntry->pszText)
-                {
-                    StringCchCat(szText, _countof(szText), TEXT(" - "));
-                    StringCchCat(szText, _countof(szText), pEntry->pszText);
-                }
+                szNarrow[cch++] = (CHAR)ch;
+                szNarrow[cch++] = (CHAR)pText->pb[++ich];
             }
+            else
+            {
+                ++ich;
+            }
+            continue;
         }
+        if (ch == L'\\' && ich + 1 < ichLast)
+            ch = REG_FILE_CHAR(pText, ++ich);
 
-        if (szText[0] == 0)
+        if (pText->bWide)
         {
-            StringCchCopy(szText, _countof(szText), TEXT("(Unknown)"));
+            if (cch + 1 < _countof(szWide))
+                szWide[cch++] = ch;
+        }
+        else
+        {
+            if (cch + 1 < _countof(szNarrow))
+                szNarrow[cch++] = (CHAR)ch;
         }
+    }
 
-        mii.fMask       = MIIM_ID | MIIM_STRING;
-        mii.wID         = 300 + iKL;
-        mii.dwTypeData  = szText;
+    if (pText->bWide)
+    {
+        szWide[cch] = 0;
+    }
+    else
+    {
+        szNarrow[cch] = 0;
+        if (!MultiByteToWideChar(pText->uCodePage, 0, szNarrow, -1, szWide, _countof(szWide)))
+            szWide[0] = 0;
+    }
 
-        hIcon = CreateTrayIcon(hKL, szImeFile);
-        if (hIcon)
+#ifdef UNICODE
+    StringCchCopyW(pszOut, cchOut, szWide);
+#else
+    if (!WideCharToMultiByte(CP_ACP, 0, szWide, -1, pszOut, (INT)cchOut, NULL, NULL))
+        pszOut[0] = 0;
+#endif
+}
+
+static VOID ParseRegFileText(const REG_FILE_TEXT *pText, SIZE_T ich)
+{
+    SIZE_T ichEOL, ichLast, ichName, ichEqual;
+    BOOL bInLayout = FALSE;
+    DWORD dwKLID = 0;
+    TCHAR szText[MAX_PATH], szVariant[MAX_PATH];
+    WCHAR ch;
+
+    szText[0] = szVariant[0] = 0;
+
+    while (ich < pText->cch)
+    {
+        ichEOL = RegFileFindEOL(pText, ich);
+
+        /* Trim the line */
+        ichLast = ichEOL;
+        while (ich < ichLast && ((ch = REG_FILE_CHAR(pText, ich)) == L' ' || ch == L'\t'))
+            ++ich;
+        while (ichLast > ich && ((ch = REG_FILE_CHAR(pText, ichLast - 1)) == L'\r' ||
+                                 ch == L' ' || ch == L'\t'))
         {
-            mii.hbmpItem = BitmapFromIcon(hIcon);
-            if (mii.hbmpItem)
-                mii.fMask |= MIIM_BITMAP;
+            --ichLast;
         }
 
-        if (hKL == hCheckKL)
+        if (ich < ichLast && REG_FILE_CHAR(pText, ich) == L'[')
         {
-            mii.fMask |= MIIM_STATE;
-            mii.fState = MFS_CHECKED;
+            if (bInLayout && szText[0])
+                AppendLayoutEntry(dwKLID, szText, _tcstoul(szVariant, NULL, 16));
+
+            szText[0] = szVariant[0] = 0;
+            bInLayout = RegFileParseSection(pText, ich, ichLast, &dwKLID);
         }
+        else if (bInLayout && ich < ichLast && REG_FILE_CHAR(pText, ich) == L'"')
+        {
+            /* "Name"="Data" */
+            ichName = ich + 1;
+            ichEqual = RegFileSkipString(pText, ichName, ichLast) + 1;
+            if (ichEqual + 1 < ichLast &&
+                REG_FILE_CHAR(pText, ichEqual) == L'=' &&
+                REG_FILE_CHAR(pText, ichEqual + 1) == L'"')
+            {
+                ich = ichEqual + 2;
+                ichLast = RegFileSkipString(pText, ich, ichLast);
 
-        InsertMenuItem(hMenu, -1, TRUE, &mii);
-        if (hIcon)
-            DestroyIcon(hIcon);
+                if (RegFileMatch(pText, ichName, ichEqual - 1 - ichName, "Layout Text"))
+                    RegFileGetString(pText, ich, ichLast, szText, _countof(szText));
+                else if (RegFileMatch(pText, ichName, ichEqual - 1 - ichName, "Layout Id"))
+                    RegFileGetString(pText, ich, ichLast, szVariant, _countof(szVariant));
+            }
+        }
+
+        ich = ichEOL + 1;
     }
 
-    hKL = NULL;
-    INT nID = TrackPopupMenu(hMenu, TPM_RETURNCMD, pt.x, pt.y, 0, hwnd, NULL);
-    if (nID != 0)
+    if (bInLayout && szText[0])
+        AppendLayoutEntry(dwKLID, szText, _tcstoul(szVariant, NULL, 16));
+}
+
+static BOOL LoadKeyboardLayoutsFromRegFile(LPCTSTR pszFile)
+{
+    HANDLE hFile, hMapping;
+    LARGE_INTEGER cbFile;
+    REG_FILE_TEXT Text;
+    CPINFO CPInfo;
+    SIZE_T ichStart = 0;
+
+    hFile = CreateFile(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    if (!GetFileSizeEx(hFile, &cbFile) || cbFile.QuadPart < 2 || cbFile.HighPart != 0)
     {
-        hKL = ahKLs[nID - 300];
+        CloseHandle(hFile);
+        return FALSE;
     }
-    DestroyMenu(hMenu);
 
-    return hKL;
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hMapping == NULL)
+        return FALSE;
+
+    Text.pb = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if (Text.pb == NULL)
+        return FALSE;
+
+    if (Text.pb[0] == 0xFF && Text.pb[1] == 0xFE)
+    {
+        /* "Windows Registry Editor Version 5.00" */
+        Text.bWide = TRUE;
+        Text.cch = cbFile.LowPart / sizeof(WCHAR);
+        Text.uCodePage = 0;
+        Text.bDBCS = FALSE;
+        ichStart = 1;
+    }
+    else
+    {
+        /* "REGEDIT4" */
+        Text.bWide = FALSE;
+        Text.cch = cbFile.LowPart;
+        Text.uCodePage = CP_ACP;
+        if (cbFile.LowPart >= 3 && Text.pb[0] == 0xEF && Text.pb[1] == 0xBB && Text.pb[2] == 0xBF)
+        {
+            Text.uCodePage = CP_UTF8;
+            ichStart = 3;
+        }
+        Text.bDBCS = Text.uCodePage != CP_UTF8 && GetCPInfo(Text.uCodePage, &CPInfo) &&
+                     CPInfo.MaxCharSize > 1;
+    }
+
+    ParseRegFileText(&Text, ichStart);
+
+    UnmapViewOfFile(Text.pb);
+    return g_cLayouts > 0;
 }
 
-static HWND GetTrayWnd(VOID)
+/*
+ * The read-only layout catalog shared by all the kbswitch instances on a host.
+ *
+ * The catalog is cached as a position-independent image (offsets only, no
+ * pointers) in a file of the common application data, one per UI language.
+ * The instances, e.g. in the sessions of a terminal server, map the file
+ * read-only, so they share its pages, and point their entries into it instead
+ * of enumerating the registry and duplicating the strings.
+ *
+ * The image is stamped with the last write time of the layout keys it was read
+ * from, and is only used while the registry still has that stamp. A stale
+ * cache is rewritten to a temporary file and moved over the old one, so a
+ * reader never maps a partial image.
+ *
+ * Only a trusted writer publishes: an elevated administrator or the system,
+ * such as the setup running "kbswitch /catalog". It creates the directory
+ * writable by the administrators alone, and the cache owned by them, and the
+ * readers trust no other owner. The instances of the other users never write
+ * it; if the cache is missing, stale, untrusted or incompatible, they load the
+ * catalog privately as before until a trusted writer refreshes it.
+ */
+#define CATALOG_MAGIC   0x5441434B // "KCAT"
+#define CATALOG_VERSION 2
+#define CATALOG_FILE_FORMAT TEXT("\\catalog.%u.%04X.%u.bin") // Version, UI language, sizeof(TCHAR)
+
+typedef struct tagCATALOG_IMAGE_ENTRY
 {
-    return FindWindow(TEXT("Shell_TrayWnd"), NULL);
-}
+    DWORD dwKLID;
+    DWORD dwVariant;
+    DWORD ibText; // Offset of the text from the top of the image
+} CATALOG_IMAGE_ENTRY, *PCATALOG_IMAGE_ENTRY;
 
-static BOOL IsWndClass(HWND hwnd, LPCTSTR pszClass)
+typedef struct tagCATALOG_IMAGE
 {
-    TCHAR szClass[128];
-    return (GetClassName(hwnd, szClass, _countof(szClass)) && _tcsicmp(szClass, pszClass) == 0);
+    DWORD dwMagic;          // CATALOG_MAGIC
+    DWORD dwVersion;        // CATALOG_VERSION
+    DWORD cbChar;           // sizeof(TCHAR) of the publisher
+    DWORD cbImage;          // The total size of the image
+    DWORD cEntries;
+    FILETIME ftStamp;       // See GetCatalogStamp
+    CATALOG_IMAGE_ENTRY Entries[ANYSIZE_ARRAY];
+} CATALOG_IMAGE, *PCATALOG_IMAGE;
+
+HANDLE g_hCatalogMapping = NULL;
+PCATALOG_IMAGE g_pCatalogImage = NULL;
+
+static VOID CloseSharedCatalog(VOID)
+{
+    if (g_pCatalogImage)
+    {
+        UnmapViewOfFile(g_pCatalogImage);
+        g_pCatalogImage = NULL;
+    }
+
+    if (g_hCatalogMapping)
+    {
+        CloseHandle(g_hCatalogMapping);
+        g_hCatalogMapping = NULL;
+    }
 }
 
-static BOOL IsKbswitchWindow(HWND hwnd)
+/*
+ * The latest last write time of the layout keys. A value written to a layout
+ * only stamps its own key, so the subkeys are looked at too; RegEnumKeyEx gives
+ * their times without opening them.
+ */
+static BOOL GetCatalogStamp(PFILETIME pftStamp)
 {
-    return IsWndClass(hwnd, KBSWITCH_CLASS);
+    HKEY hLayoutsKey;
+    TCHAR szKeyName[MAX_PATH];
+    DWORD dwIndex, cchKeyName;
+    FILETIME ftWrite;
+    LONG error;
+
+    if (RegOpenKey(HKEY_LOCAL_MACHINE, KEYBOARD_LAYOUTS_KEY, &hLayoutsKey) != ERROR_SUCCESS)
+        return FALSE;
+
+    error = RegQueryInfoKey(hLayoutsKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                            NULL, NULL, pftStamp);
+    for (dwIndex = 0; error == ERROR_SUCCESS; ++dwIndex)
+    {
+        cchKeyName = _countof(szKeyName);
+        if (RegEnumKeyEx(hLayoutsKey, dwIndex, szKeyName, &cchKeyName, NULL, NULL, NULL,
+                         &ftWrite) != ERROR_SUCCESS)
+        {
+            break;
+        }
+
+        if (CompareFileTime(&ftWrite, pftStamp) > 0)
+            *pftStamp = ftWrite;
+    }
+
+    RegCloseKey(hLayoutsKey);
+    return error == ERROR_SUCCESS;
 }
 
-// NOTE: GetWindowThreadProcessId function doesn't return the correct value on
-//       console window.
-static BOOL IsConsoleWnd(HWND hwnd)
+static BOOL GetCatalogPath(LPTSTR pszPath, BOOL bCreate)
 {
-    return IsWndClass(hwnd, TEXT("ConsoleWindowClass"));
+    TCHAR szFileName[32];
+    SECURITY_ATTRIBUTES sa = { sizeof(sa) };
+
+    if (FAILED(SHGetFolderPath(NULL, CSIDL_COMMON_APPDATA, NULL, 0, pszPath)))
+        return FALSE;
+
+    StringCchCat(pszPath, MAX_PATH, TEXT("\\kbswitch"));
+    if (bCreate)
+    {
+        /* Readable by all, writable by the administrators and the system */
+        if (ConvertStringSecurityDescriptorToSecurityDescriptor(
+                TEXT("D:P(A;OICI;GA;;;SY)(A;OICI;GA;;;BA)(A;OICI;GRGX;;;AU)"), SDDL_REVISION_1,
+                &sa.lpSecurityDescriptor, NULL))
+        {
+            CreateDirectory(pszPath, &sa);
+            LocalFree(sa.lpSecurityDescriptor);
+        }
+    }
+
+    StringCchPrintf(szFileName, _countof(szFileName), CATALOG_FILE_FORMAT, CATALOG_VERSION,
+                    GetUserDefaultUILanguage(), (UINT)sizeof(TCHAR));
+    return SUCCEEDED(StringCchCat(pszPath, MAX_PATH, szFileName));
 }
 
-static BOOL IsTrayWnd(HWND hwnd)
+static BOOL IsCatalogFileTrusted(HANDLE hFile)
 {
-    return g_hwndTrayWnd == hwnd;
+    PSECURITY_DESCRIPTOR pSD;
+    PSID pOwner;
+    BOOL bTrusted;
+
+    if (GetSecurityInfo(hFile, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &pOwner, NULL,
+                        NULL, NULL, &pSD) != ERROR_SUCCESS)
+    {
+        return FALSE;
+    }
+
+    bTrusted = IsWellKnownSid(pOwner, WinLocalSystemSid) ||
+               IsWellKnownSid(pOwner, WinBuiltinAdministratorsSid);
+
+    LocalFree(pSD);
+    return bTrusted;
 }
 
-static HWND GetTopLevelOwner(HWND hwndTarget)
+// Can this process write a cache that the others trust?
+static BOOL IsCatalogWriter(VOID)
 {
-    HWND hwndDesktop = GetDesktopWindow();
-    HWND hTopWnd = hwndTarget;
+    static const WELL_KNOWN_SID_TYPE aTypes[] = { WinBuiltinAdministratorsSid, WinLocalSystemSid };
+    DWORD_PTR Sid[SECURITY_MAX_SID_SIZE / sizeof(DWORD_PTR) + 1];
+    DWORD cbSid;
+    BOOL bMember;
+    UINT i;
 
-    for (;;)
+    for (i = 0; i < _countof(aTypes); ++i)
     {
-        if (hwndTarget == NULL || hwndTarget == hwndDesktop)
-            break;
-        hTopWnd = hwndTarget;
-        if ((GetWindowLongPtrW(hwndTarget, GWL_STYLE) & WS_CHILD) == 0)
-            hwndTarget = GetWindow(hwndTarget, GW_OWNER);
-        else
-            hwndTarget = GetParent(hwndTarget);
+        cbSid = sizeof(Sid);
+        if (CreateWellKnownSid(aTypes[i], NULL, Sid, &cbSid) &&
+            CheckTokenMembership(NULL, Sid, &bMember) && bMember)
+        {
+            return TRUE;
+        }
     }
 
-    return hTopWnd;
+    return FALSE;
 }
 
-static HWND RealGetTopLevelOwner(HWND hwndTarget)
+static BOOL IsCatalogImageValid(PCATALOG_IMAGE pImage, SIZE_T cbView, const FILETIME *pftStamp)
 {
-    DWORD dwTID1, dwTID2;
-    HWND hwndTopLevel = GetTopLevelOwner(hwndTarget);
+    const BYTE *pbImage = (const BYTE *)pImage;
+    DWORD iEntry, cbEntries;
+
+    if (cbView < sizeof(CATALOG_IMAGE) ||
+        pImage->dwMagic != CATALOG_MAGIC ||
+        pImage->dwVersion != CATALOG_VERSION ||
+        pImage->cbChar != sizeof(TCHAR) ||
+        CompareFileTime(&pImage->ftStamp, pftStamp) != 0 ||
+        pImage->cbImage > cbView ||
+        pImage->cEntries == 0)
+    {
+        return FALSE;
+    }
 
-    dwTID1 = GetWindowThreadProcessId(hwndTopLevel, NULL);
-    dwTID2 = GetWindowThreadProcessId(hwndTarget, NULL);
-    if (dwTID1 != dwTID2)
-        hwndTopLevel = hwndTarget;
+    cbEntries = pImage->cEntries * sizeof(CATALOG_IMAGE_ENTRY);
+    if (cbEntries / sizeof(CATALOG_IMAGE_ENTRY) != pImage->cEntries ||
+        FIELD_OFFSET(CATALOG_IMAGE, Entries) + cbEntries > pImage->cbImage)
+    {
+        return FALSE;
+    }
 
-    return hwndTopLevel;
+    /* The string pool is terminated, so every text in range is terminated */
+    if (*(const TCHAR *)(pbImage + pImage->cbImage - sizeof(TCHAR)) != 0)
+        return FALSE;
+
+    for (iEntry = 0; iEntry < pImage->cEntries; ++iEntry)
+    {
+        if (pImage->Entries[iEntry].ibText < FIELD_OFFSET(CATALOG_IMAGE, Entries) + cbEntries ||
+            pImage->Entries[iEntry].ibText >= pImage->cbImage)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
-static BOOL IsWndIgnored(HWND hwndTarget)
+// Lets the entries point into g_pCatalogImage.
+static BOOL AttachSharedCatalog(VOID)
 {
-    HWND hwndTopLevel = RealGetTopLevelOwner(hwndTarget);
+    PCATALOG_IMAGE pImage = g_pCatalogImage;
+    DWORD iEntry;
 
-    return !IsWindowVisible(hwndTopLevel) ||
-           IsTrayWnd(hwndTopLevel) ||
-           IsKbswitchWindow(hwndTopLevel);
+    FreeKeyboardLayouts();
+
+    g_pLayouts = LocalAlloc(LPTR, pImage->cEntries * sizeof(LAYOUT_ENTRY));
+    if (g_pLayouts == NULL)
+        return FALSE;
+
+    for (iEntry = 0; iEntry < pImage->cEntries; ++iEntry)
+    {
+        g_pLayouts[iEntry].dwKLID = pImage->Entries[iEntry].dwKLID;
+        g_pLayouts[iEntry].dwVariant = pImage->Entries[iEntry].dwVariant;
+        g_pLayouts[iEntry].pszText = (LPTSTR)((LPBYTE)pImage + pImage->Entries[iEntry].ibText);
+    }
+
+    g_cLayouts = g_cLayoutsCapacity = pImage->cEntries;
+    g_bLayoutsShared = TRUE;
+    return TRUE;
 }
 
-static void SetLastActive(HWND hwndTarget, INT line)
+// The entries must not point into the mapped catalog when it is called.
+static BOOL OpenSharedCatalog(VOID)
 {
-    if (g_hwndLastActive != hwndTarget)
-    {
+    TCHAR szPath[MAX_PATH];
+    FILETIME ftStamp;
+    LARGE_INTEGER cbFile;
+    HANDLE hFile;
+
+    if (!GetCatalogStamp(&ftStamp))
+        return FALSE;
+
+    if (g_pCatalogImage && CompareFileTime(&g_pCatalogImage->ftStamp, &ftStamp) != 0)
+        CloseSharedCatalog(); // The layouts have changed since
+
+    if (g_pCatalogImage == NULL)
+    {
+        if (!GetCatalogPath(szPath, FALSE))
+            return FALSE;
+
+        hFile = CreateFile(szPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return FALSE;
+
+        if (!GetFileSizeEx(hFile, &cbFile) || cbFile.HighPart != 0 ||
+            !IsCatalogFileTrusted(hFile))
+        {
+            CloseHandle(hFile);
+            return FALSE;
+        }
+
+        g_hCatalogMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hFile);
+        if (g_hCatalogMapping == NULL)
+            return FALSE;
+
+        g_pCatalogImage = MapViewOfFile(g_hCatalogMapping, FILE_MAP_READ, 0, 0, 0);
+        if (g_pCatalogImage == NULL ||
+            !IsCatalogImageValid(g_pCatalogImage, cbFile.LowPart, &ftStamp))
+        {
+            CloseSharedCatalog();
+            return FALSE;
+        }
+    }
+
+    return AttachSharedCatalog();
+}
+
+// pftStamp: the stamp taken before the catalog was read
+static VOID PublishSharedCatalog(const FILETIME *pftStamp)
+{
+    TCHAR szPath[MAX_PATH], szTempPath[MAX_PATH];
+    PCATALOG_IMAGE pImage;
+    HANDLE hFile;
+    SECURITY_ATTRIBUTES sa = { sizeof(sa) };
+    DWORD cbImage, ibText, cbText, cbWritten;
+    BOOL bWritten = FALSE;
+    UINT i;
+
+    /* The others would not trust it; don't even try */
+    if (!IsCatalogWriter())
+        return;
+
+    cbImage = FIELD_OFFSET(CATALOG_IMAGE, Entries) + g_cLayouts * sizeof(CATALOG_IMAGE_ENTRY);
+    for (i = 0; i < g_cLayouts; ++i)
+    {
+        cbImage += (DWORD)(_tcslen(g_pLayouts[i].pszText) + 1) * sizeof(TCHAR);
+    }
+
+    if (!GetCatalogPath(szPath, TRUE))
+        return;
+
+    pImage = LocalAlloc(LPTR, cbImage);
+    if (pImage == NULL)
+        return;
+
+    pImage->dwMagic = CATALOG_MAGIC;
+    pImage->dwVersion = CATALOG_VERSION;
+    pImage->cbChar = sizeof(TCHAR);
+    pImage->cbImage = cbImage;
+    pImage->cEntries = g_cLayouts;
+    pImage->ftStamp = *pftStamp;
+
+    ibText = FIELD_OFFSET(CATALOG_IMAGE, Entries) + g_cLayouts * sizeof(CATALOG_IMAGE_ENTRY);
+    for (i = 0; i < g_cLayouts; ++i)
+    {
+        pImage->Entries[i].dwKLID = g_pLayouts[i].dwKLID;
+        pImage->Entries[i].dwVariant = g_pLayouts[i].dwVariant;
+        pImage->Entries[i].ibText = ibText;
+
+        cbText = (DWORD)(_tcslen(g_pLayouts[i].pszText) + 1) * sizeof(TCHAR);
+        CopyMemory((LPBYTE)pImage + ibText, g_pLayouts[i].pszText, cbText);
+        ibText += cbText;
+    }
+
+    StringCchPrintf(szTempPath, _countof(szTempPath), TEXT("%s.%lu"), szPath,
+                    GetCurrentProcessId());
+    /* Owned by the administrators, even if written by a member of them */
+    hFile = INVALID_HANDLE_VALUE;
+    if (ConvertStringSecurityDescriptorToSecurityDescriptor(
+            TEXT("O:BAD:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GRGX;;;AU)"), SDDL_REVISION_1,
+            &sa.lpSecurityDescriptor, NULL))
+    {
+        hFile = CreateFile(szTempPath, GENERIC_WRITE, 0, &sa, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+        LocalFree(sa.lpSecurityDescriptor);
+    }
+
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        bWritten = WriteFile(hFile, pImage, cbImage, &cbWritten, NULL) && cbWritten == cbImage;
+        CloseHandle(hFile);
+
+        if (!bWritten || !MoveFileEx(szTempPath, szPath, MOVEFILE_REPLACE_EXISTING))
+        {
+            DeleteFile(szTempPath);
+            bWritten = FALSE;
+        }
+    }
+
+    LocalFree(pImage);
+
+    /* Use the published copy from now on */
+    if (bWritten)
+        OpenSharedCatalog();
+}
+
+static BOOL LoadKeyboardLayouts(VOID)
+{
+    FILETIME ftStamp;
+    BOOL bStamped;
+
+    FreeKeyboardLayouts();
+    g_cKLMisses = 0;
+
+    if (!g_szLayoutsRegFile[0] && OpenSharedCatalog())
+    {
+        g_bCatalogFull = TRUE;
+        return TRUE;
+    }
+
+    g_pLayouts = LocalAlloc(LPTR, MAX_LAYOUT_KEYS * sizeof(LAYOUT_ENTRY));
+    if (g_pLayouts == NULL)
+    {
+        return FALSE;
+    }
+    g_cLayoutsCapacity = MAX_LAYOUT_KEYS;
+
+    if (g_szLayoutsRegFile[0])
+    {
+        g_bCatalogFull = LoadKeyboardLayoutsFromRegFile(g_szLayoutsRegFile);
+        return g_bCatalogFull;
+    }
+
+    bStamped = GetCatalogStamp(&ftStamp);
+    if (!LoadKeyboardLayoutsFromRegistry())
+        return FALSE;
+
+    g_bCatalogFull = TRUE;
+    if (bStamped)
+        PublishSharedCatalog(&ftStamp);
+    return TRUE;
+}
+
+/*
+ * Lazy catalog loading.
+ *
+ * Most users have two or three layouts installed, and only those are ever looked
+ * up. With the "LazyCatalog" setting, only the entries of the installed layouts
+ * are read at startup; the entries of newly seen HKLs are resolved on demand and
+ * misses are remembered. The whole catalog is read only when a feature needs it.
+ * A shared catalog, when available, is used as a whole since it costs nothing.
+ */
+static INT ReadLayoutKeyByKLID(HKEY hLayoutsKey, DWORD dwKLID)
+{
+    TCHAR szKeyName[CCH_LAYOUT_ID + 1];
+
+    StringCchPrintf(szKeyName, _countof(szKeyName), TEXT("%08lX"), dwKLID);
+    if (!ReadLayoutKey(hLayoutsKey, szKeyName, NULL))
+        return -1;
+
+    return g_cLayouts - 1;
+}
+
+static INT ResolveLayoutEntry(HKL hKL)
+{
+    HKEY hLayoutsKey;
+    TCHAR szKeyName[MAX_PATH];
+    DWORD dwIndex, dwVariant;
+    INT iEntry = -1;
+    UINT i;
+
+    for (i = 0; i < g_cKLMisses; ++i)
+    {
+        if (g_ahKLMisses[i] == hKL)
+            return -1;
+    }
+
+    if (RegOpenKey(HKEY_LOCAL_MACHINE, KEYBOARD_LAYOUTS_KEY, &hLayoutsKey) == ERROR_SUCCESS)
+    {
+        if (IS_IME_HKL(hKL))
+        {
+            iEntry = ReadLayoutKeyByKLID(hLayoutsKey, (DWORD)(DWORD_PTR)hKL);
+        }
+        else if (IS_VARIANT_HKL(hKL))
+        {
+            /* Only the keys of the language are opened */
+            dwVariant = GET_HKL_VARIANT(hKL);
+            for (dwIndex = 0; dwIndex < 256; ++dwIndex)
+            {
+                if (RegEnumKey(hLayoutsKey, dwIndex, szKeyName, _countof(szKeyName)) != ERROR_SUCCESS)
+                    break;
+
+                if (LOWORD(_tcstoul(szKeyName, NULL, 16)) == LOWORD(hKL) &&
+                    ReadLayoutKey(hLayoutsKey, szKeyName, &dwVariant))
+                {
+                    iEntry = g_cLayouts - 1;
+                    break;
+                }
+            }
+        }
+        else
+        {
+            iEntry = ReadLayoutKeyByKLID(hLayoutsKey, LOWORD(hKL));
+            if (iEntry == -1)
+                iEntry = ReadLayoutKeyByKLID(hLayoutsKey, HIWORD(hKL));
+        }
+
+        RegCloseKey(hLayoutsKey);
+    }
+
+    if (iEntry == -1)
+    {
+        g_ahKLMisses[g_iNextKLMiss] = hKL;
+        g_iNextKLMiss = (g_iNextKLMiss + 1) % _countof(g_ahKLMisses);
+        g_cKLMisses = min(g_cKLMisses + 1, _countof(g_ahKLMisses));
+    }
+
+    return iEntry;
+}
+
+static BOOL LoadInstalledLayouts(VOID)
+{
+    HKL ahKLs[256];
+    UINT iKL, cKLs;
+
+    FreeKeyboardLayouts();
+    g_cKLMisses = 0;
+
+    /* A .reg file is mapped at once anyway */
+    if (g_szLayoutsRegFile[0])
+        return LoadKeyboardLayouts();
+
+    if (OpenSharedCatalog())
+    {
+        g_bCatalogFull = TRUE;
+        return TRUE;
+    }
+
+    g_bCatalogFull = FALSE;
+
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        if (ScanLayoutEntries(ahKLs[iKL]) == -1)
+            ResolveLayoutEntry(ahKLs[iKL]);
+    }
+
+    return TRUE;
+}
+
+// For the UI thread only; the event thread scans the catalog under g_csCatalog.
+INT FindLayoutEntry(HKL hKL)
+{
+    LONGLONG qwSpan;
+    INT iEntry;
+
+    /* The catalog belongs to the loader thread until it has finished */
+    if (!g_bCatalogReady)
+        return -1;
+
+    qwSpan = BeginSpan();
+    iEntry = ScanLayoutEntries(hKL);
+    if (iEntry == -1 && !g_bCatalogFull)
+    {
+        EnterCriticalSection(&g_csCatalog);
+        iEntry = ResolveLayoutEntry(hKL);
+        LeaveCriticalSection(&g_csCatalog);
+    }
+    EndSpan("FindLayoutEntry", (DWORD)(DWORD_PTR)hKL, qwSpan);
+
+    return iEntry;
+}
+
+/*
+ * Search keys for the layout picker.
+ *
+ * Built once when the catalog arrives: for each entry, the lowercase layout text,
+ * the language name and the KLID joined by spaces. A keystroke in the picker is
+ * then a scan of these short strings, which is far below a millisecond even for
+ * thousands of layouts.
+ */
+LPTSTR *g_ppszLayoutKeys = NULL; // LocalAlloc'ed array of malloc'ed strings
+UINT g_cLayoutKeys = 0;
+
+static VOID FreeLayoutIndex(VOID)
+{
+    UINT i;
+    for (i = 0; i < g_cLayoutKeys; ++i)
+    {
+        free(g_ppszLayoutKeys[i]);
+    }
+
+    LocalFree(g_ppszLayoutKeys);
+    g_ppszLayoutKeys = NULL;
+    g_cLayoutKeys = 0;
+}
+
+static VOID BuildLayoutIndex(VOID)
+{
+    TCHAR szKey[MAX_PATH * 2], szLang[MAX_PATH];
+    UINT i;
+
+    FreeLayoutIndex();
+
+    g_ppszLayoutKeys = LocalAlloc(LPTR, g_cLayouts * sizeof(LPTSTR));
+    if (g_ppszLayoutKeys == NULL)
+        return;
+
+    for (i = 0; i < g_cLayouts; ++i)
+    {
+        szLang[0] = 0;
+        GetLocaleInfo(LOWORD(g_pLayouts[i].dwKLID), LOCALE_SLANGUAGE, szLang, _countof(szLang));
+
+        StringCchPrintf(szKey, _countof(szKey), TEXT("%s %s %08lX"),
+                        g_pLayouts[i].pszText, szLang, g_pLayouts[i].dwKLID);
+        CharLower(szKey);
+        g_ppszLayoutKeys[i] = _tcsdup(szKey);
+    }
+
+    g_cLayoutKeys = g_cLayouts;
+}
+
+// Ranks a search key for the lowercase query. Lower is better; -1 is no match.
+static INT RankLayoutKey(LPCTSTR pszKey, LPCTSTR pszQuery)
+{
+    LPCTSTR pch;
+
+    if (pszQuery[0] == 0)
+        return 2;
+
+    pch = _tcsstr(pszKey, pszQuery);
+    if (pch == NULL)
+        return -1;
+    if (pch == pszKey)
+        return 0;
+
+    /* Does any word start with the query? */
+    do
+    {
+        if (pch[-1] == _T(' ') || pch[-1] == _T('-') || pch[-1] == _T('('))
+            return 1;
+        pch = _tcsstr(pch + 1, pszQuery);
+    } while (pch);
+
+    return 2;
+}
+
+// Loads the whole catalog if it has been loaded lazily. Returns TRUE if loaded.
+static BOOL EnsureFullCatalog(VOID)
+{
+    BOOL bLoaded;
+
+    if (g_bCatalogFull)
+        return TRUE;
+
+    /* LoadKeyboardLayouts frees the lazy entries first; get them back if it fails */
+    EnterCriticalSection(&g_csCatalog);
+    bLoaded = LoadKeyboardLayouts();
+    if (!bLoaded)
+        LoadInstalledLayouts();
+    LeaveCriticalSection(&g_csCatalog);
+
+    BuildLayoutIndex();
+    return bLoaded;
+}
+
+/*
+ * Accounting of the GDI/USER handles.
+ *
+ * A process has a quota of GDI and USER objects, and kbswitch runs for weeks.
+ * The handles created for the tray, the menu and the drawing of the icons are
+ * counted per subsystem, with the high-water marks; whatever is still alive
+ * when kbswitch exits is reported as a leak.
+ */
+typedef enum tagHANDLE_OWNER
+{
+    HANDLE_OWNER_TRAY,  // The icon in the tray
+    HANDLE_OWNER_MENU,  // The keyboard menu and its items
+    HANDLE_OWNER_ICON,  // The scratch objects of CreateTrayIcon
+    HANDLE_OWNER_MAX
+} HANDLE_OWNER;
+
+C_ASSERT(HANDLE_OWNER_MAX == KBS_HANDLE_OWNERS);
+
+static const LPCSTR s_apszHandleOwners[HANDLE_OWNER_MAX] = { "tray", "menu", "icon" };
+
+KBS_HANDLE_ACCOUNT g_HandleAccounts[HANDLE_OWNER_MAX];
+
+#ifndef GR_GDIOBJECTS_PEAK
+    #define GR_GDIOBJECTS_PEAK 2
+    #define GR_USEROBJECTS_PEAK 4
+#endif
+
+static VOID TrackHandle(HANDLE_OWNER iOwner, HANDLE hObject)
+{
+    PKBS_HANDLE_ACCOUNT pAccount = &g_HandleAccounts[iOwner];
+
+    if (hObject == NULL)
+        return;
+
+    ++pAccount->cCreated;
+    if (++pAccount->cLive > pAccount->cPeak)
+        pAccount->cPeak = pAccount->cLive;
+}
+
+static VOID UntrackHandle(HANDLE_OWNER iOwner, HANDLE hObject)
+{
+    if (hObject)
+        --g_HandleAccounts[iOwner].cLive;
+}
+
+static VOID DeleteTrackedObject(HANDLE_OWNER iOwner, HGDIOBJ hObject)
+{
+    UntrackHandle(iOwner, hObject);
+    DeleteObject(hObject);
+}
+
+static VOID DestroyTrackedIcon(HANDLE_OWNER iOwner, HICON hIcon)
+{
+    UntrackHandle(iOwner, hIcon);
+    DestroyIcon(hIcon);
+}
+
+static VOID GetHandleCounts(PKBSCTL_HANDLES pHandles)
+{
+    HANDLE hProcess = GetCurrentProcess();
+
+    pHandles->cGdiObjects = GetGuiResources(hProcess, GR_GDIOBJECTS);
+    pHandles->cGdiPeak = GetGuiResources(hProcess, GR_GDIOBJECTS_PEAK);
+    pHandles->cUserObjects = GetGuiResources(hProcess, GR_USEROBJECTS);
+    pHandles->cUserPeak = GetGuiResources(hProcess, GR_USEROBJECTS_PEAK);
+    CopyMemory(pHandles->Accounts, g_HandleAccounts, sizeof(g_HandleAccounts));
+}
+
+static VOID ReportHandles(VOID)
+{
+    KBSCTL_HANDLES Handles;
+    UINT iOwner;
+
+    GetHandleCounts(&Handles);
+    TRACE("Handles: GDI %lu (peak %lu), USER %lu (peak %lu)\n",
+          Handles.cGdiObjects, Handles.cGdiPeak, Handles.cUserObjects, Handles.cUserPeak);
+
+    for (iOwner = 0; iOwner < HANDLE_OWNER_MAX; ++iOwner)
+    {
+        PKBS_HANDLE_ACCOUNT pAccount = &Handles.Accounts[iOwner];
+        TRACE("Handles of %s: %lu created, peak %ld%s\n", s_apszHandleOwners[iOwner],
+              pAccount->cCreated, pAccount->cPeak, pAccount->cLive ? ", LEAKED:" : "");
+        if (pAccount->cLive)
+            TRACE("    %ld handles\n", pAccount->cLive);
+    }
+}
+
+static HBITMAP BitmapFromIcon(HICON hIcon)
+{
+    HDC hdcScreen = GetDC(NULL);
+    HDC hdc = CreateCompatibleDC(hdcScreen);
+    INT cxIcon = GetSystemMetrics(SM_CXSMICON);
+    INT cyIcon = GetSystemMetrics(SM_CYSMICON);
+    HBITMAP hbm = CreateCompatibleBitmap(hdcScreen, cxIcon, cyIcon);
+    HGDIOBJ hbmOld;
+
+    if (hbm != NULL)
+    {
+        hbmOld = SelectObject(hdc, hbm);
+        DrawIconEx(hdc, 0, 0, hIcon, cxIcon, cyIcon, 0, GetSysColorBrush(COLOR_MENU), DI_NORMAL);
+        SelectObject(hdc, hbmOld);
+    }
+
+    DeleteDC(hdc);
+    ReleaseDC(NULL, hdcScreen);
+    TrackHandle(HANDLE_OWNER_MENU, hbm);
+    return hbm;
+}
+
+static BOOL
+GetSystemLibraryPath(LPTSTR szPath, SIZE_T cchPath, LPCTSTR FileName)
+{
+    if (!GetSystemDirectory(szPath, cchPath))
+        return FALSE;
+
+    StringCchCat(szPath, cchPath, TEXT("\\"));
+    StringCchCat(szPath, cchPath, FileName);
+    return TRUE;
+}
+
+static VOID GetLayoutBadge(HKL hKL, TCHAR szBuf[4])
+{
+    /* Getting "EN", "FR", etc. from English, French, ... */
+    LANGID LangID = LOWORD(hKL);
+    if (GetLocaleInfo(LangID,
+                      LOCALE_SABBREVLANGNAME | LOCALE_NOUSEROVERRIDE,
+                      szBuf,
+                      4) == 0)
+    {
+        szBuf[0] = szBuf[1] = _T('?');
+    }
+    szBuf[2] = 0; /* Truncate the identifier to two characters: "ENG" --> "EN" etc. */
+}
+
+// The returned icon is accounted to iOwner; destroy it with DestroyTrackedIcon.
+static HICON
+CreateTrayIcon(HKL hKL, LPCTSTR szImeFile OPTIONAL, HANDLE_OWNER iOwner)
+{
+    TCHAR szBuf[4];
+    HDC hdcScreen, hdc;
+    HBITMAP hbmColor, hbmMono, hBmpOld;
+    HFONT hFont, hFontOld;
+    BOOL bStockFont;
+    LOGFONT lf;
+    RECT rect;
+    ICONINFO IconInfo;
+    HICON hIcon;
+    INT cxIcon = GetSystemMetrics(SM_CXSMICON);
+    INT cyIcon = GetSystemMetrics(SM_CYSMICON);
+    TCHAR szPath[MAX_PATH];
+
+    if (szImeFile && szImeFile[0])
+    {
+        if (GetSystemLibraryPath(szPath, _countof(szPath), szImeFile))
+        {
+            hIcon = NULL;
+            ExtractIconEx(szPath, 0, NULL, &hIcon, 1);
+            if (hIcon)
+            {
+                TrackHandle(iOwner, hIcon);
+                return hIcon;
+            }
+        }
+    }
+
+    GetLayoutBadge(hKL, szBuf);
+
+    /* Create hdc, hbmColor and hbmMono */
+    hdcScreen = GetDC(NULL);
+    hdc = CreateCompatibleDC(hdcScreen);
+    hbmColor = CreateCompatibleBitmap(hdcScreen, cxIcon, cyIcon);
+    ReleaseDC(NULL, hdcScreen);
+    hbmMono = CreateBitmap(cxIcon, cyIcon, 1, 1, NULL);
+    TrackHandle(HANDLE_OWNER_ICON, hdc);
+    TrackHandle(HANDLE_OWNER_ICON, hbmColor);
+    TrackHandle(HANDLE_OWNER_ICON, hbmMono);
+
+    /* Checking NULL */
+    if (!hdc || !hbmColor || !hbmMono)
+    {
+        if (hbmMono)
+            DeleteTrackedObject(HANDLE_OWNER_ICON, hbmMono);
+        if (hbmColor)
+            DeleteTrackedObject(HANDLE_OWNER_ICON, hbmColor);
+        if (hdc)
+        {
+            UntrackHandle(HANDLE_OWNER_ICON, hdc);
+            DeleteDC(hdc);
+        }
+        return NULL;
+    }
+
+    /* Create a font */
+    hFont = NULL;
+    if (SystemParametersInfo(SPI_GETICONTITLELOGFONT, sizeof(lf), &lf, 0))
+    {
+        /* Override the current size with something manageable */
+        lf.lfHeight = -11;
+        lf.lfWidth = 0;
+        hFont = CreateFontIndirect(&lf);
+        TrackHandle(HANDLE_OWNER_ICON, hFont);
+    }
+    bStockFont = (hFont == NULL);
+    if (bStockFont)
+        hFont = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
+
+    SetRect(&rect, 0, 0, cxIcon, cyIcon);
+
+    /* Draw hbmColor */
+    hBmpOld = SelectObject(hdc, hbmColor);
+    SetDCBrushColor(hdc, GetSysColor(COLOR_HIGHLIGHT));
+    FillRect(hdc, &rect, (HBRUSH)GetStockObject(DC_BRUSH));
+    hFontOld = SelectObject(hdc, hFont);
+    SetTextColor(hdc, GetSysColor(COLOR_HIGHLIGHTTEXT));
+    SetBkMode(hdc, TRANSPARENT);
+    DrawText(hdc, szBuf, 2, &rect, DT_SINGLELINE | DT_CENTER | DT_VCENTER);
+    SelectObject(hdc, hFontOld);
+
+    /* Fill hbmMono with black */
+    SelectObject(hdc, hbmMono);
+    PatBlt(hdc, 0, 0, cxIcon, cyIcon, BLACKNESS);
+    SelectObject(hdc, hBmpOld);
+
+    /* Create an icon from hbmColor and hbmMono */
+    IconInfo.fIcon = TRUE;
+    IconInfo.xHotspot = IconInfo.yHotspot = 0;
+    IconInfo.hbmColor = hbmColor;
+    IconInfo.hbmMask = hbmMono;
+    hIcon = CreateIconIndirect(&IconInfo);
+    TrackHandle(iOwner, hIcon);
+
+    /* Clean up; the stock font must not be deleted */
+    if (!bStockFont)
+        DeleteTrackedObject(HANDLE_OWNER_ICON, hFont);
+    DeleteTrackedObject(HANDLE_OWNER_ICON, hbmMono);
+    DeleteTrackedObject(HANDLE_OWNER_ICON, hbmColor);
+    UntrackHandle(HANDLE_OWNER_ICON, hdc);
+    DeleteDC(hdc);
+
+    return hIcon;
+}
+
+HKL ShowKeyboardMenu(HWND hwnd, HKL hCheckKL, POINT pt)
+{
+    HKL hKL, ahKLs[256];
+    HBITMAP ahbmItems[256]; // The menu doesn't own the bitmaps of the items
+    UINT iKL, cKLs;
+    HMENU hMenu = CreatePopupMenu();
+    MENUITEMINFO mii = { sizeof(mii) };
+    TCHAR szText[MAX_PATH], szImeFile[MAX_PATH];
+    PLAYOUT_ENTRY pEntry;
+    INT iEntry;
+    HICON hIcon;
+
+    TrackHandle(HANDLE_OWNER_MENU, hMenu);
+
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        hKL = ahKLs[iKL];
+        ahbmItems[iKL] = NULL;
+
+        iEntry = FindLayoutEntry(hKL);
+        if (iEntry == -1 && g_bCatalogReady)
+            continue;
+
+        pEntry = (iEntry != -1) ? &g_pLayouts[iEntry] : NULL;
+
+        szText[0] = 0;
+        szImeFile[0] = 0;
+
+        if (IS_IME_HKL(hKL))
+        {
+            ImmGetDescription(hKL, szText, _countof(szText));
+            ImmGetIMEFileName(hKL, szImeFile, _countof(szImeFile));
+        }
+        else
+        {
+            GetLocaleInfo(LOWORD(hKL), LOCALE_SLANGUAGE, szText, _countof(szText));
+            if (LOWORD(hKL) != HIWORD(hKL))
+            {
+                if (pEntry && pEntry->pszText)
+                {
+                    StringCchCat(szText, _countof(szText), TEXT(" - "));
+                    StringCchCat(szText, _countof(szText), pEntry->pszText);
+                }
+            }
+        }
+
+        if (szText[0] == 0)
+        {
+            StringCchCopy(szText, _countof(szText), TEXT("(Unknown)"));
+        }
+
+        mii.fMask       = MIIM_ID | MIIM_STRING;
+        mii.wID         = 300 + iKL;
+        mii.dwTypeData  = szText;
+
+        hIcon = CreateTrayIcon(hKL, szImeFile, HANDLE_OWNER_MENU);
+        if (hIcon)
+        {
+            mii.hbmpItem = ahbmItems[iKL] = BitmapFromIcon(hIcon);
+            if (mii.hbmpItem)
+                mii.fMask |= MIIM_BITMAP;
+        }
+
+        if (hKL == hCheckKL)
+        {
+            mii.fMask |= MIIM_STATE;
+            mii.fState = MFS_CHECKED;
+        }
+
+        InsertMenuItem(hMenu, -1, TRUE, &mii);
+        if (hIcon)
+            DestroyTrackedIcon(HANDLE_OWNER_MENU, hIcon);
+    }
+
+    hKL = NULL;
+    INT nID = TrackPopupMenu(hMenu, TPM_RETURNCMD, pt.x, pt.y, 0, hwnd, NULL);
+    if (nID != 0)
+    {
+        hKL = ahKLs[nID - 300];
+    }
+    UntrackHandle(HANDLE_OWNER_MENU, hMenu);
+    DestroyMenu(hMenu);
+
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        if (ahbmItems[iKL])
+            DeleteTrackedObject(HANDLE_OWNER_MENU, ahbmItems[iKL]);
+    }
+
+    return hKL;
+}
+
+/*
+ * Unresponsive windows.
+ *
+ * Posting to a hung window costs nothing, but an activation by kbsdll would
+ * hold its slot until it times out, and the focus would be given to a window
+ * that can't take it. A thread whose activation has timed out is avoided for
+ * HUNG_THREAD_PERIOD, before Windows itself reports its windows as hung. The
+ * list belongs to the thread of the events, like the layout cache.
+ */
+#define MAX_HUNG_THREADS 8
+#define HUNG_THREAD_PERIOD 5000
+
+typedef struct tagHUNG_THREAD
+{
+    DWORD dwThreadId;
+    DWORD dwTick;
+} HUNG_THREAD;
+
+HUNG_THREAD g_HungThreads[MAX_HUNG_THREADS];
+UINT g_iNextHungThread = 0;
+
+static VOID MarkWndUnresponsive(HWND hwndTarget)
+{
+    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+    UINT i;
+
+    if (!dwThreadId)
+        return;
+
+    for (i = 0; i < MAX_HUNG_THREADS; ++i)
+    {
+        if (g_HungThreads[i].dwThreadId == dwThreadId)
+            break;
+    }
+    if (i == MAX_HUNG_THREADS)
+    {
+        i = g_iNextHungThread;
+        g_iNextHungThread = (g_iNextHungThread + 1) % MAX_HUNG_THREADS;
+        g_HungThreads[i].dwThreadId = dwThreadId;
+    }
+    g_HungThreads[i].dwTick = GetTickCount();
+}
+
+static BOOL IsWndResponsive(HWND hwndTarget)
+{
+    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+    UINT i;
+
+    for (i = 0; i < MAX_HUNG_THREADS; ++i)
+    {
+        if (g_HungThreads[i].dwThreadId == dwThreadId &&
+            GetTickCount() - g_HungThreads[i].dwTick < HUNG_THREAD_PERIOD)
+        {
+            ++g_Counters.cUnresponsiveSkips;
+            return FALSE;
+        }
+    }
+
+    if (IsHungAppWindow(hwndTarget))
+    {
+        ++g_Counters.cUnresponsiveSkips;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static HWND GetTrayWnd(VOID)
+{
+    return FindWindow(TEXT("Shell_TrayWnd"), NULL);
+}
+
+static BOOL IsWndClass(HWND hwnd, LPCTSTR pszClass)
+{
+    TCHAR szClass[128];
+    return (GetClassName(hwnd, szClass, _countof(szClass)) && _tcsicmp(szClass, pszClass) == 0);
+}
+
+static BOOL IsKbswitchWindow(HWND hwnd)
+{
+    return IsWndClass(hwnd, KBSWITCH_CLASS);
+}
+
+// NOTE: GetWindowThreadProcessId function doesn't return the correct value on
+//       console window.
+static BOOL IsConsoleWnd(HWND hwnd)
+{
+    return IsWndClass(hwnd, TEXT("ConsoleWindowClass"));
+}
+
+static BOOL IsTrayWnd(HWND hwnd)
+{
+    return g_hwndTrayWnd == hwnd;
+}
+
+static HWND GetTopLevelOwner(HWND hwndTarget)
+{
+    HWND hwndDesktop = GetDesktopWindow();
+    HWND hTopWnd = hwndTarget;
+
+    for (;;)
+    {
+        if (hwndTarget == NULL || hwndTarget == hwndDesktop)
+            break;
+        hTopWnd = hwndTarget;
+        if ((GetWindowLongPtrW(hwndTarget, GWL_STYLE) & WS_CHILD) == 0)
+            hwndTarget = GetWindow(hwndTarget, GW_OWNER);
+        else
+            hwndTarget = GetParent(hwndTarget);
+    }
+
+    return hTopWnd;
+}
+
+static HWND RealGetTopLevelOwner(HWND hwndTarget)
+{
+    DWORD dwTID1, dwTID2;
+    HWND hwndTopLevel = GetTopLevelOwner(hwndTarget);
+
+    dwTID1 = GetWindowThreadProcessId(hwndTopLevel, NULL);
+    dwTID2 = GetWindowThreadProcessId(hwndTarget, NULL);
+    if (dwTID1 != dwTID2)
+        hwndTopLevel = hwndTarget;
+
+    return hwndTopLevel;
+}
+
+static BOOL IsWndIgnored(HWND hwndTarget)
+{
+    HWND hwndTopLevel = RealGetTopLevelOwner(hwndTarget);
+
+    return !IsWindowVisible(hwndTopLevel) ||
+           IsTrayWnd(hwndTopLevel) ||
+           IsKbswitchWindow(hwndTopLevel);
+}
+
+static void SetLastActive(HWND hwndTarget, INT line)
+{
+    if (g_hwndLastActive != hwndTarget)
+    {
         TRACE("SetLastActive: %d (%d)\n", hwndTarget, line);
         DumpWndInfo(hwndTarget);
         g_hwndLastActive = hwndTarget;
     }
-}
+}
+
+static DWORD GetCodePageBitField(HWND hwnd)
+{
+    CHARSETINFO CharSet;
+    HDC hDC = GetDC(hwnd);
+    UINT uCharSet = GetTextCharset(hDC);
+    TranslateCharsetInfo((LPDWORD)(UINT_PTR)uCharSet, &CharSet, TCI_SRCCHARSET);
+    ReleaseDC(hwnd, hDC);
+    return CharSet.fs.fsCsb[0];
+}
+
+static BOOL IsHKLCharSetSupported(HKL hKL)
+{
+    LOCALESIGNATURE Signature;
+    if (!GetLocaleInfoW(LOWORD(hKL), LOCALE_FONTSIGNATURE, (LPWSTR)&Signature, sizeof(Signature)))
+        return FALSE;
+    return !!(Signature.lsCsbSupported[0] & g_dwCodePageBitField);
+}
+
+static BOOL GetImeFile(LPTSTR szImeFile, SIZE_T cchImeFile, HKL hKL)
+{
+    szImeFile[0] = UNICODE_NULL;
+
+    if (hKL == NULL || !IS_IME_HKL(hKL))
+        return FALSE;
+
+    return ImmGetIMEFileName(hKL, szImeFile, cchImeFile);
+}
+
+// Gets the tooltip text of the tray icon. Works before the catalog is loaded.
+static VOID GetLayoutTip(HKL hKL, LPTSTR pszTip, SIZE_T cchTip)
+{
+    INT iEntry = FindLayoutEntry(hKL);
+    if (iEntry != -1)
+    {
+        StringCchCopy(pszTip, cchTip, g_pLayouts[iEntry].pszText);
+        return;
+    }
+
+    pszTip[0] = 0;
+    GetLocaleInfo(LOWORD(hKL), LOCALE_SLANGUAGE, pszTip, (INT)cchTip);
+}
+
+static VOID
+AddTrayIcon(HWND hwnd, HKL hKL)
+{
+    NOTIFYICONDATA tnid = { sizeof(tnid), hwnd, 1, NIF_ICON | NIF_MESSAGE | NIF_TIP };
+    TCHAR szImeFile[80];
+
+    GetImeFile(szImeFile, _countof(szImeFile), hKL);
+
+    tnid.uCallbackMessage = WM_NOTIFYICONMSG;
+    tnid.hIcon = CreateTrayIcon(hKL, szImeFile, HANDLE_OWNER_TRAY);
+    GetLayoutTip(hKL, tnid.szTip, _countof(tnid.szTip));
+
+    Shell_NotifyIcon(NIM_ADD, &tnid);
+
+    if (g_hTrayIcon)
+        DestroyTrackedIcon(HANDLE_OWNER_TRAY, g_hTrayIcon);
+    g_hTrayIcon = tnid.hIcon;
+    g_hTrayKL = hKL;
+}
+
+static VOID
+DeleteTrayIcon(HWND hwnd)
+{
+    NOTIFYICONDATA tnid = { sizeof(tnid), hwnd, 1 };
+    Shell_NotifyIcon(NIM_DELETE, &tnid);
+
+    if (g_hTrayIcon)
+    {
+        DestroyTrackedIcon(HANDLE_OWNER_TRAY, g_hTrayIcon);
+        g_hTrayIcon = NULL;
+    }
+}
+
+/*
+ * The snapshot of the current layout for the other processes; see kbssnap.h.
+ * Only the UI thread writes it.
+ */
+HANDLE g_hSnapshotMapping = NULL;
+PKBS_SNAPSHOT g_pSnapshot = NULL;
+HANDLE g_ahSnapshotEvents[2] = { NULL, NULL };
+
+static VOID CloseSnapshot(VOID)
+{
+    if (g_pSnapshot)
+    {
+        UnmapViewOfFile(g_pSnapshot);
+        g_pSnapshot = NULL;
+    }
+    if (g_hSnapshotMapping)
+    {
+        CloseHandle(g_hSnapshotMapping);
+        g_hSnapshotMapping = NULL;
+    }
+    if (g_ahSnapshotEvents[0])
+    {
+        CloseHandle(g_ahSnapshotEvents[0]);
+        g_ahSnapshotEvents[0] = NULL;
+    }
+    if (g_ahSnapshotEvents[1])
+    {
+        CloseHandle(g_ahSnapshotEvents[1]);
+        g_ahSnapshotEvents[1] = NULL;
+    }
+}
+
+static VOID WriteSnapshot(const KBS_SNAPSHOT_DATA *pData)
+{
+    DWORD dwSequence = (DWORD)g_pSnapshot->lSequence + 2;
+
+    ResetEvent(g_ahSnapshotEvents[KBS_SNAPSHOT_EVENT_INDEX(dwSequence + 2)]);
+
+    InterlockedIncrement(&g_pSnapshot->lSequence); /* Odd: being written */
+    CopyMemory(&g_pSnapshot->Data, pData, sizeof(*pData));
+    InterlockedIncrement(&g_pSnapshot->lSequence);
+
+    SetEvent(g_ahSnapshotEvents[KBS_SNAPSHOT_EVENT_INDEX(dwSequence)]);
+}
+
+/*
+ * Only one kbswitch runs in a session, so a block that already exists is one a
+ * reader still holds after a previous kbswitch has exited, maybe in the middle
+ * of a write. It is taken over: the header is reset, and the sequence goes on
+ * from where it was, so that the readers waiting on it see the change. The
+ * block and its events are open to the user alone; ones that another user
+ * created first are refused, and kbswitch publishes no snapshot.
+ */
+static HANDLE CreateSnapshotEvent(PSECURITY_ATTRIBUTES psa, LPCTSTR pszName)
+{
+    HANDLE hEvent = CreateEvent(psa, TRUE, FALSE, pszName);
+
+    if (hEvent && GetLastError() == ERROR_ALREADY_EXISTS && !KbsIsTrustedOwner(hEvent))
+    {
+        CloseHandle(hEvent);
+        hEvent = NULL;
+    }
+    return hEvent;
+}
+
+static BOOL CreateSnapshot(VOID)
+{
+    KBS_SNAPSHOT_DATA Data;
+    KBS_USER_SECURITY Security;
+    PSECURITY_ATTRIBUTES psa = KbsInitUserSecurity(&Security);
+    MEMORY_BASIC_INFORMATION mbi;
+
+    g_hSnapshotMapping = CreateFileMapping(INVALID_HANDLE_VALUE, psa, PAGE_READWRITE,
+                                           0, sizeof(KBS_SNAPSHOT), KBS_SNAPSHOT_NAME);
+    if (g_hSnapshotMapping == NULL)
+        return FALSE;
+
+    if (GetLastError() == ERROR_ALREADY_EXISTS && !KbsIsTrustedOwner(g_hSnapshotMapping))
+    {
+        TRACE("The snapshot was created by someone else\n");
+        CloseSnapshot();
+        return FALSE;
+    }
+
+    g_pSnapshot = MapViewOfFile(g_hSnapshotMapping, FILE_MAP_WRITE, 0, 0, 0);
+    g_ahSnapshotEvents[0] = CreateSnapshotEvent(psa, KBS_SNAPSHOT_EVENT_0);
+    g_ahSnapshotEvents[1] = CreateSnapshotEvent(psa, KBS_SNAPSHOT_EVENT_1);
+    if (g_pSnapshot == NULL || g_ahSnapshotEvents[0] == NULL || g_ahSnapshotEvents[1] == NULL ||
+        !VirtualQuery(g_pSnapshot, &mbi, sizeof(mbi)) || mbi.RegionSize < sizeof(KBS_SNAPSHOT))
+    {
+        CloseSnapshot();
+        return FALSE;
+    }
+
+    g_pSnapshot->dwVersion = KBS_SNAPSHOT_VERSION;
+    g_pSnapshot->cbSize = sizeof(KBS_SNAPSHOT);
+
+    ZeroMemory(&Data, sizeof(Data));
+    Data.dwProcessId = GetCurrentProcessId();
+    if (g_pSnapshot->lSequence & 1)
+    {
+        /* Finish the write of the dead writer */
+        CopyMemory(&g_pSnapshot->Data, &Data, sizeof(Data));
+        InterlockedIncrement(&g_pSnapshot->lSequence);
+    }
+    WriteSnapshot(&Data);
+
+    MemoryBarrier();
+    g_pSnapshot->dwMagic = KBS_SNAPSHOT_MAGIC;
+    return TRUE;
+}
+
+static VOID PublishSnapshot(HKL hKL)
+{
+    KBS_SNAPSHOT_DATA Data;
+    TCHAR szBadge[4], szTip[64];
+    INT iKL;
+
+    if (g_pSnapshot == NULL)
+        return;
+
+    ZeroMemory(&Data, sizeof(Data));
+    Data.qwHKL = (ULONG_PTR)hKL;
+    Data.qwForeground = (ULONG_PTR)g_hwndLastActive;
+    Data.dwProcessId = GetCurrentProcessId();
+
+    iKL = FindLayoutEntry(hKL);
+    Data.dwKLID = (iKL != -1) ? g_pLayouts[iKL].dwKLID : LOWORD(hKL);
+
+    /* The tray is refreshed every second; only changes are published */
+    if (g_pSnapshot->Data.qwHKL == Data.qwHKL &&
+        g_pSnapshot->Data.qwForeground == Data.qwForeground &&
+        g_pSnapshot->Data.dwKLID == Data.dwKLID)
+    {
+        return;
+    }
+
+    GetLayoutBadge(hKL, szBadge);
+    GetLayoutTip(hKL, szTip, _countof(szTip));
+#ifdef UNICODE
+    StringCchCopyW(Data.szBadge, _countof(Data.szBadge), szBadge);
+    StringCchCopyW(Data.szText, _countof(Data.szText), szTip);
+#else
+    MultiByteToWideChar(CP_ACP, 0, szBadge, -1, Data.szBadge, _countof(Data.szBadge));
+    MultiByteToWideChar(CP_ACP, 0, szTip, -1, Data.szText, _countof(Data.szText));
+    Data.szBadge[_countof(Data.szBadge) - 1] = 0;
+    Data.szText[_countof(Data.szText) - 1] = 0;
+#endif
+
+    WriteSnapshot(&Data);
+}
+
+// Tells the readers that kbswitch is gone, then closes the snapshot
+static VOID RetractSnapshot(VOID)
+{
+    KBS_SNAPSHOT_DATA Data;
+
+    if (g_pSnapshot)
+    {
+        ZeroMemory(&Data, sizeof(Data));
+        WriteSnapshot(&Data);
+    }
+
+    CloseSnapshot();
+}
+
+static VOID
+UpdateTrayIcon(HWND hwnd, HKL hKL)
+{
+    NOTIFYICONDATA tnid = { sizeof(tnid), hwnd, 1, NIF_ICON | NIF_MESSAGE | NIF_TIP };
+    TCHAR szImeFile[80];
+    LONGLONG qwSpan = BeginSpan(), qwStep;
+
+    if (g_bCatalogReady && FindLayoutEntry(hKL) == -1)
+    {
+        EndSpan("UpdateTrayIcon", (DWORD)(DWORD_PTR)hKL, qwSpan);
+        return;
+    }
+
+    GetImeFile(szImeFile, _countof(szImeFile), hKL);
+
+    tnid.uCallbackMessage = WM_NOTIFYICONMSG;
+    qwStep = BeginSpan();
+    tnid.hIcon = CreateTrayIcon(hKL, szImeFile, HANDLE_OWNER_TRAY);
+    EndSpan("CreateTrayIcon", (DWORD)(DWORD_PTR)hKL, qwStep);
+    GetLayoutTip(hKL, tnid.szTip, _countof(tnid.szTip));
+
+    qwStep = BeginSpan();
+    Shell_NotifyIcon(NIM_MODIFY, &tnid);
+    EndSpan("Shell_NotifyIcon", NIM_MODIFY, qwStep);
+
+    if (g_hTrayIcon)
+        DestroyTrackedIcon(HANDLE_OWNER_TRAY, g_hTrayIcon);
+    g_hTrayIcon = tnid.hIcon;
+    g_hTrayKL = hKL;
+
+    PublishSnapshot(hKL);
+    EndSpan("UpdateTrayIcon", (DWORD)(DWORD_PTR)hKL, qwSpan);
+}
+
+static void
+RememberWindowHKL(HWND hwnd, HWND hwndTarget, HKL hKL)
+{
+    TCHAR szHWND[32];
+
+    StringCchPrintf(szHWND, _countof(szHWND), TEXT("%p"), hwndTarget);
+
+    SetProp(hwnd, szHWND, hKL);
+}
+
+static HKL
+RecallWindowHKL(HWND hwnd, HWND hwndTarget)
+{
+    TCHAR szHWND[32];
+    DWORD dwThreadId;
+    HKL hKL;
+
+    StringCchPrintf(szHWND, _countof(szHWND), TEXT("%p"), hwndTarget);
+
+    hKL = (HKL)GetProp(hwnd, szHWND);
+    if (hKL == NULL)
+    {
+        dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+        hKL = GetKeyboardLayout(dwThreadId);
+        if (hKL == NULL)
+            hKL = GetKeyboardLayout(0);
+    }
+
+    return hKL;
+}
+
+static void
+ForgetWindowHKL(HWND hwnd, HWND hwndTarget)
+{
+    TCHAR szHWND[32];
+
+    StringCchPrintf(szHWND, _countof(szHWND), TEXT("%p"), hwndTarget);
+    RemoveProp(hwnd, szHWND);
+}
+
+/*
+ * A cache of the layouts of the threads, for the event thread.
+ *
+ * GetKeyboardLayout of another thread is a query into win32k, and every
+ * activation used to make one. The layout of a thread is cached when it is
+ * queried and refreshed by WM_LANGUAGE. The notification is not raised for
+ * every change on Vista+, so the entries expire after the "LayoutCacheTTL"
+ * setting (in ms; 0 disables the cache), and the polling of OnTimer never uses
+ * the cache. An entry is dropped when the window it was seen with is destroyed.
+ * The thread IDs are hashed into a fixed table; a full probe window evicts its
+ * oldest entry. The global mode keeps its per-thread state in the same table.
+ */
+#define LAYOUT_CACHE_SIZE   256 // A power of 2
+#define LAYOUT_CACHE_PROBES 4
+
+typedef struct tagLAYOUT_CACHE_ENTRY
+{
+    DWORD dwThreadId;   // 0 if free
+    DWORD dwTick;       // When hKL was known to be current
+    HWND hwnd;          // The window it was seen with
+    HKL hKL;
+    DWORD dwSwitchTick; // When the global mode last switched the thread
+    DWORD dwPass;       // The last propagation that has seen the thread
+} LAYOUT_CACHE_ENTRY, *PLAYOUT_CACHE_ENTRY;
+
+LAYOUT_CACHE_ENTRY g_LayoutCache[LAYOUT_CACHE_SIZE];
+
+static PLAYOUT_CACHE_ENTRY FindLayoutCacheEntry(DWORD dwThreadId, BOOL bCreate)
+{
+    /* Thread IDs are multiples of 4 */
+    UINT iHash = ((dwThreadId >> 2) * 2654435761U) >> 24;
+    PLAYOUT_CACHE_ENTRY pEntry, pVictim = NULL;
+    UINT i;
+
+    for (i = 0; i < LAYOUT_CACHE_PROBES; ++i)
+    {
+        pEntry = &g_LayoutCache[(iHash + i) & (LAYOUT_CACHE_SIZE - 1)];
+        if (pEntry->dwThreadId == dwThreadId)
+            return pEntry;
+
+        if (!pVictim || (pVictim->dwThreadId &&
+                         (!pEntry->dwThreadId || pEntry->dwTick - pVictim->dwTick > 0x80000000)))
+        {
+            pVictim = pEntry;
+        }
+    }
+
+    if (!bCreate)
+        return NULL;
+
+    if (pVictim->dwThreadId)
+        ++g_Counters.cLayoutCacheEvictions;
+
+    ZeroMemory(pVictim, sizeof(*pVictim));
+    pVictim->dwThreadId = dwThreadId;
+    return pVictim;
+}
+
+static VOID CacheThreadLayout(HWND hwndTarget, HKL hKL)
+{
+    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+    PLAYOUT_CACHE_ENTRY pEntry;
+
+    if (!dwThreadId || !hKL || !g_dwLayoutCacheTTL)
+        return;
+
+    pEntry = FindLayoutCacheEntry(dwThreadId, TRUE);
+    pEntry->dwTick = GetTickCount();
+    pEntry->hwnd = hwndTarget;
+    pEntry->hKL = hKL;
+}
+
+static HKL GetThreadLayout(HWND hwndTarget)
+{
+    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+    PLAYOUT_CACHE_ENTRY pEntry;
+    HKL hKL;
+
+    if (dwThreadId && g_dwLayoutCacheTTL)
+    {
+        pEntry = FindLayoutCacheEntry(dwThreadId, FALSE);
+        if (pEntry && pEntry->hKL && GetTickCount() - pEntry->dwTick < g_dwLayoutCacheTTL)
+        {
+            ++g_Counters.cLayoutCacheHits;
+            return pEntry->hKL;
+        }
+        ++g_Counters.cLayoutCacheMisses;
+    }
+
+    hKL = GetKeyboardLayout(dwThreadId);
+    CacheThreadLayout(hwndTarget, hKL);
+    return hKL;
+}
+
+// The layout of the thread is about to change; WM_LANGUAGE caches the new one
+static VOID InvalidateThreadLayout(HWND hwndTarget)
+{
+    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+    PLAYOUT_CACHE_ENTRY pEntry;
+
+    if (dwThreadId && (pEntry = FindLayoutCacheEntry(dwThreadId, FALSE)) != NULL)
+        pEntry->hKL = NULL;
+}
+
+static VOID ForgetThreadLayout(HWND hwndTarget)
+{
+    UINT i;
+
+    /* The window is gone; its thread can't be asked */
+    for (i = 0; i < LAYOUT_CACHE_SIZE; ++i)
+    {
+        if (g_LayoutCache[i].dwThreadId && g_LayoutCache[i].hwnd == hwndTarget)
+            g_LayoutCache[i].dwThreadId = 0;
+    }
+}
+
+static void RequestLayout(HWND hwndLastActive, HKL hKL)
+{
+    // The training must not take the focus from the user
+    if (!g_cTrainRounds && IsWndResponsive(hwndLastActive))
+        SetForegroundWindow(hwndLastActive);
+
+    BOOL bSupported = IsHKLCharSetSupported(hKL);
+    PostMessage(hwndLastActive, WM_INPUTLANGCHANGEREQUEST, bSupported, (LPARAM)hKL);
+    InvalidateThreadLayout(hwndLastActive);
+    ++g_Counters.cActivationsFallback;
+
+    TRACE("hKL--: %p\n", hKL);
+}
+
+static void ChooseLayout(HWND hwnd, HKL hKL)
+{
+    HWND hwndTarget = g_hwndLastActive;
+    if (hwndTarget == NULL)
+        return;
+
+    HWND hwndTopLevel = GetTopLevelOwner(hwndTarget);
+    DWORD dwTID1 = GetWindowThreadProcessId(hwndTopLevel, NULL);
+    DWORD dwTID2 = GetWindowThreadProcessId(hwndTarget, NULL);
+    if (dwTID1 != dwTID2)
+    {
+        hwndTopLevel = hwndTarget;
+    }
+
+    HWND hwndLastActive = GetLastActivePopup(hwndTopLevel);
+
+    if (g_dwActivationSeq)
+    {
+        KillTimer(hwnd, ACTIVATE_TIMER_ID);
+        g_fnKbsCancelActivation(g_dwActivationSeq);
+        g_dwActivationSeq = 0;
+    }
+
+    // Let the hook activate the layout on the window's own thread
+    if (g_fnKbsActivateLayout && IsWndResponsive(hwndLastActive))
+        g_dwActivationSeq = g_fnKbsActivateLayout(hwndLastActive, hKL);
+
+    if (g_dwActivationSeq)
+    {
+        g_hwndActivation = hwndLastActive;
+        g_hKLActivation = hKL;
+        SetTimer(hwnd, ACTIVATE_TIMER_ID, ACTIVATE_TIMEOUT, NULL);
+
+        // Give the focus back only if the menu of ours has taken it
+        if (GetForegroundWindow() == g_hwndMain)
+            SetForegroundWindow(hwndLastActive);
+
+        TRACE("hKL--: %p (#%lu)\n", hKL, g_dwActivationSeq);
+        return;
+    }
+
+    RequestLayout(hwndLastActive, hKL);
+}
+
+// The activation by kbsdll has failed or timed out
+static void AbandonActivation(HWND hwnd, BOOL bFallback)
+{
+    KillTimer(hwnd, ACTIVATE_TIMER_ID);
+    if (g_dwActivationSeq == 0)
+        return;
+
+    // Too late to cancel if the hook has already run it
+    if (!g_fnKbsCancelActivation(g_dwActivationSeq))
+        bFallback = FALSE;
+    g_dwActivationSeq = 0;
+
+    // Still not activated: count it and ask the window the old way
+    if (bFallback)
+    {
+        ++g_Counters.cActivationTimeouts;
+        MarkWndUnresponsive(g_hwndActivation);
+        RequestLayout(g_hwndActivation, g_hKLActivation);
+    }
+}
+
+/*
+ * The global mode ("GlobalMode" setting).
+ *
+ * One layout for the whole desktop: a layout chosen by the user, or switched to
+ * in the foreground window, is propagated to the threads of all the visible
+ * top-level windows, and a window that is activated on another layout is
+ * switched back. A propagation is one pass of EnumWindows on the thread of the
+ * events. Each thread is asked once per pass, by WM_INPUTLANGCHANGEREQUEST and
+ * without touching the focus; the activations of kbsdll are left to the chosen
+ * window. A thread that is already on the layout is skipped. A thread that was
+ * switched within the "GlobalModeInterval" setting (in ms) is left for a
+ * second pass, run by PROPAGATE_TIMER_ID, so that a burst of switches can't
+ * flood it.
+ */
+#define PROPAGATE_TIMER_ID 997
+
+typedef struct tagPROPAGATION
+{
+    HKL hKL;
+    DWORD dwSkipThreadId;   // Switched by ChooseLayout
+    DWORD dwTick;
+    UINT cWindows;
+    BOOL bDeferred;
+} PROPAGATION, *PPROPAGATION;
+
+BOOL g_bGlobalMode = FALSE; // The "GlobalMode" setting
+DWORD g_dwGlobalModeInterval = 200; // The "GlobalModeInterval" setting
+HKL g_hGlobalKL = NULL; // The layout of the desktop, in the global mode
+DWORD g_dwPropagationPass = 0;
+
+static BOOL CALLBACK PropagateLayoutProc(HWND hwndTarget, LPARAM lParam)
+{
+    PPROPAGATION pPropagation = (PPROPAGATION)lParam;
+    PLAYOUT_CACHE_ENTRY pEntry;
+    DWORD dwThreadId, dwProcessId;
+
+    if (!IsWindowVisible(hwndTarget) || IsTrayWnd(hwndTarget))
+        return TRUE;
+
+    ++pPropagation->cWindows;
+
+    /* Asked again by the next pass */
+    if (!IsWndResponsive(hwndTarget))
+    {
+        pPropagation->bDeferred = TRUE;
+        return TRUE;
+    }
+
+    dwThreadId = GetWindowThreadProcessId(hwndTarget, &dwProcessId);
+    if (!dwThreadId || dwThreadId == pPropagation->dwSkipThreadId)
+        return TRUE;
+
+    /* The training switches its own windows only */
+    if (dwProcessId == GetCurrentProcessId() && !g_cTrainRounds)
+        return TRUE;
+
+    pEntry = FindLayoutCacheEntry(dwThreadId, TRUE);
+    if (pEntry->dwPass == g_dwPropagationPass)
+        return TRUE;
+    pEntry->dwPass = g_dwPropagationPass;
+
+    if (GetKeyboardLayout(dwThreadId) == pPropagation->hKL)
+    {
+        ++g_Counters.cPropagationSkips;
+        return TRUE;
+    }
+
+    if (pEntry->dwSwitchTick &&
+        pPropagation->dwTick - pEntry->dwSwitchTick < g_dwGlobalModeInterval)
+    {
+        ++g_Counters.cPropagationDeferrals;
+        pPropagation->bDeferred = TRUE;
+        return TRUE;
+    }
+
+    if (PostMessage(hwndTarget, WM_INPUTLANGCHANGEREQUEST,
+                    IsHKLCharSetSupported(pPropagation->hKL), (LPARAM)pPropagation->hKL))
+    {
+        ++g_Counters.cPropagationSwitches;
+        pEntry->dwSwitchTick = pPropagation->dwTick | 1; // Never 0
+        pEntry->hKL = NULL; // The cached layout is about to change
+    }
+
+    return TRUE;
+}
+
+static void PropagateLayout(HWND hwnd, HKL hKL, DWORD dwSkipThreadId)
+{
+    PROPAGATION Propagation;
+    LARGE_INTEGER liFreq, liBegin, liEnd;
+    DWORD dwTime;
+
+    if (hKL == NULL)
+        return;
+
+    KillTimer(hwnd, PROPAGATE_TIMER_ID);
+    g_hGlobalKL = hKL;
+
+    ZeroMemory(&Propagation, sizeof(Propagation));
+    Propagation.hKL = hKL;
+    Propagation.dwSkipThreadId = dwSkipThreadId;
+    Propagation.dwTick = GetTickCount();
+    if (++g_dwPropagationPass == 0)
+        ++g_dwPropagationPass;
+
+    QueryPerformanceCounter(&liBegin);
+    if (g_cTrainRounds)
+        EnumThreadWindows(GetCurrentThreadId(), PropagateLayoutProc, (LPARAM)&Propagation);
+    else
+        EnumWindows(PropagateLayoutProc, (LPARAM)&Propagation);
+    QueryPerformanceCounter(&liEnd);
+    QueryPerformanceFrequency(&liFreq);
+
+    dwTime = (DWORD)((liEnd.QuadPart - liBegin.QuadPart) * 1000000 / liFreq.QuadPart);
+    ++g_Counters.cPropagations;
+    g_Counters.cLastPropagationWindows = Propagation.cWindows;
+    g_Counters.dwLastPropagationTime = dwTime;
+    if (g_Counters.dwMaxPropagationTime < dwTime)
+        g_Counters.dwMaxPropagationTime = dwTime;
+
+    TRACE("PropagateLayout: %p, %u windows in %luus%s\n", hKL, Propagation.cWindows, dwTime,
+          (Propagation.bDeferred ? ", deferred" : ""));
+
+    if (Propagation.bDeferred)
+        SetTimer(hwnd, PROPAGATE_TIMER_ID, g_dwGlobalModeInterval, NULL);
+}
+
+static void OnPropagateTimer(HWND hwnd)
+{
+    KillTimer(hwnd, PROPAGATE_TIMER_ID);
+    if (g_bGlobalMode)
+        PropagateLayout(hwnd, g_hGlobalKL, 0);
+}
+
+// The layout chosen by the user
+static void OnChooseLayout(HWND hwnd, HKL hKL)
+{
+    ChooseLayout(hwnd, hKL);
+
+    if (g_bGlobalMode && g_hwndLastActive)
+        PropagateLayout(hwnd, hKL, GetWindowThreadProcessId(g_hwndLastActive, NULL));
+}
+
+// OnChooseLayout on the thread that handles the events
+static void PostChooseLayout(HWND hwnd, HKL hKL)
+{
+    if (g_hwndEvents && PostMessage(g_hwndEvents, WM_CHOOSELAYOUT, 0, (LPARAM)hKL))
+        return;
+
+    OnChooseLayout(hwnd, hKL);
+}
+
+/*
+ * Per-application layout policy.
+ *
+ * Each subkey of "Rules" holds optional "Class", "Process" and "Title" values
+ * (the title is a pattern with '*' and '?') and a "Layout" value (a KLID like
+ * "00000409"). The rules are tried in the order of their subkey names. Missing
+ * values match anything. The rules are compiled once at startup: the strings
+ * are lowercased and hashed, so that an activation only compares integers
+ * until a rule is about to match. The rules are also indexed in buckets by the
+ * hash of their class, or of their process if they have no class; the rules
+ * with neither are in one more list. An activation only walks the bucket of
+ * its class, the bucket of its process and that list, merged in the order of
+ * the rules, so its cost grows with the rules that may match it, not with all
+ * of them.
+ */
+#define RULE_BUCKETS    64          // A power of two
+#define RULE_NONE       ((UINT)-1)  // The end of a bucket
+
+typedef struct tagLAYOUT_RULE
+{
+    DWORD dwClassHash;      // 0 if any
+    DWORD dwProcessHash;    // 0 if any
+    LPTSTR pszClass;        // malloc'ed, lowercase
+    LPTSTR pszProcess;      // malloc'ed, lowercase
+    LPTSTR pszTitle;        // malloc'ed, lowercase
+    DWORD dwKLID;
+    UINT iNext;             // The next rule of its bucket
+} LAYOUT_RULE, *PLAYOUT_RULE;
+
+PLAYOUT_RULE g_pRules = NULL; // LocalAlloc'ed
+UINT g_cRules = 0;
+UINT g_aiClassRules[RULE_BUCKETS];
+UINT g_aiProcessRules[RULE_BUCKETS]; // Of the rules without a class
+UINT g_iOtherRules = RULE_NONE;
+BOOL g_bRulesNeedProcess = FALSE, g_bRulesNeedTitle = FALSE;
+
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+    #define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#endif
+
+// FNV-1a. Never returns zero.
+static DWORD HashString(LPCTSTR psz)
+{
+    DWORD dwHash = 2166136261U;
+
+    for (; *psz; ++psz)
+    {
+        dwHash ^= (TBYTE)*psz;
+        dwHash *= 16777619U;
+    }
+
+    return dwHash ? dwHash : 1;
+}
+
+static BOOL WildcardMatch(LPCTSTR pszPattern, LPCTSTR pszText)
+{
+    LPCTSTR pszStar = NULL, pszResume = NULL;
+
+    while (*pszText)
+    {
+        if (*pszPattern == _T('*'))
+        {
+            pszStar = pszPattern++;
+            pszResume = pszText;
+        }
+        else if (*pszPattern == _T('?') || *pszPattern == *pszText)
+        {
+            ++pszPattern;
+            ++pszText;
+        }
+        else if (pszStar)
+        {
+            pszPattern = pszStar + 1;
+            pszText = ++pszResume;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    while (*pszPattern == _T('*'))
+        ++pszPattern;
+
+    return *pszPattern == 0;
+}
+
+static BOOL RegQueryString(HKEY hKey, LPCTSTR pszName, LPTSTR pszValue, DWORD cchValue)
+{
+    DWORD cb = cchValue * sizeof(TCHAR), dwType;
+    LONG error;
+
+    pszValue[0] = 0;
+    error = RegQueryValueEx(hKey, pszName, NULL, &dwType, (LPBYTE)pszValue, &cb);
+    if (error != ERROR_SUCCESS || dwType != REG_SZ)
+    {
+        pszValue[0] = 0;
+        return FALSE;
+    }
+
+    pszValue[cchValue - 1] = 0;
+    return pszValue[0] != 0;
+}
+
+static LPTSTR DupLowerString(LPTSTR psz)
+{
+    if (!psz[0])
+        return NULL;
+    CharLower(psz);
+    return _tcsdup(psz);
+}
+
+static VOID FreeLayoutPolicy(VOID)
+{
+    UINT i;
+    for (i = 0; i < g_cRules; ++i)
+    {
+        free(g_pRules[i].pszClass);
+        free(g_pRules[i].pszProcess);
+        free(g_pRules[i].pszTitle);
+    }
+
+    LocalFree(g_pRules);
+    g_pRules = NULL;
+    g_cRules = 0;
+    g_bRulesNeedProcess = g_bRulesNeedTitle = FALSE;
+}
+
+static VOID IndexLayoutPolicy(VOID)
+{
+    PUINT piHead;
+    UINT i;
+
+    for (i = 0; i < RULE_BUCKETS; ++i)
+        g_aiClassRules[i] = g_aiProcessRules[i] = RULE_NONE;
+    g_iOtherRules = RULE_NONE;
+
+    /* Backwards, so that every bucket lists its rules in order */
+    for (i = g_cRules; i-- > 0; )
+    {
+        if (g_pRules[i].dwClassHash)
+            piHead = &g_aiClassRules[g_pRules[i].dwClassHash & (RULE_BUCKETS - 1)];
+        else if (g_pRules[i].dwProcessHash)
+            piHead = &g_aiProcessRules[g_pRules[i].dwProcessHash & (RULE_BUCKETS - 1)];
+        else
+            piHead = &g_iOtherRules;
+
+        g_pRules[i].iNext = *piHead;
+        *piHead = i;
+    }
+}
+
+static VOID LoadLayoutPolicy(VOID)
+{
+    HKEY hRulesKey, hKey;
+    DWORD dwIndex, cSubKeys = 0, dwKLID;
+    TCHAR szKeyName[MAX_PATH], szValue[MAX_PATH];
+    PLAYOUT_RULE pRule;
+
+    FreeLayoutPolicy();
+
+    if (RegOpenKeyEx(HKEY_CURRENT_USER, KBSWITCH_REG_KEY TEXT("\\Rules"), 0, KEY_READ,
+                     &hRulesKey) != ERROR_SUCCESS)
+    {
+        return;
+    }
+
+    if (RegQueryInfoKey(hRulesKey, NULL, NULL, NULL, &cSubKeys, NULL, NULL, NULL, NULL, NULL,
+                        NULL, NULL) != ERROR_SUCCESS || cSubKeys == 0)
+    {
+        RegCloseKey(hRulesKey);
+        return;
+    }
+
+    g_pRules = LocalAlloc(LPTR, cSubKeys * sizeof(LAYOUT_RULE));
+    if (g_pRules == NULL)
+    {
+        RegCloseKey(hRulesKey);
+        return;
+    }
+
+    for (dwIndex = 0; dwIndex < cSubKeys; ++dwIndex)
+    {
+        if (RegEnumKey(hRulesKey, dwIndex, szKeyName, _countof(szKeyName)) != ERROR_SUCCESS)
+            break;
+
+        if (RegOpenKeyEx(hRulesKey, szKeyName, 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+            continue;
+
+        /* A rule without a valid layout leaves its slot untouched */
+        dwKLID = 0;
+        if (RegQueryString(hKey, TEXT("Layout"), szValue, _countof(szValue)))
+            dwKLID = _tcstoul(szValue, NULL, 16);
+
+        if (dwKLID)
+        {
+            pRule = &g_pRules[g_cRules++];
+            pRule->dwKLID = dwKLID;
+
+            RegQueryString(hKey, TEXT("Class"), szValue, _countof(szValue));
+            pRule->pszClass = DupLowerString(szValue);
+            if (pRule->pszClass)
+                pRule->dwClassHash = HashString(pRule->pszClass);
+
+            RegQueryString(hKey, TEXT("Process"), szValue, _countof(szValue));
+            pRule->pszProcess = DupLowerString(szValue);
+            if (pRule->pszProcess)
+            {
+                pRule->dwProcessHash = HashString(pRule->pszProcess);
+                g_bRulesNeedProcess = TRUE;
+            }
+
+            RegQueryString(hKey, TEXT("Title"), szValue, _countof(szValue));
+            pRule->pszTitle = DupLowerString(szValue);
+            if (pRule->pszTitle)
+                g_bRulesNeedTitle = TRUE;
+        }
+
+        RegCloseKey(hKey);
+    }
+
+    RegCloseKey(hRulesKey);
+    IndexLayoutPolicy();
+    TRACE("LoadLayoutPolicy: %u rules\n", g_cRules);
+}
+
+// Gets the lowercase file name of the process of hwnd, like "devenv.exe".
+static BOOL GetWindowProcessName(HWND hwnd, LPTSTR pszName, SIZE_T cchName)
+{
+    DWORD dwPID = 0;
+    HANDLE hProcess;
+    TCHAR szPath[MAX_PATH];
+    LPTSTR pch;
+
+    pszName[0] = 0;
+    GetWindowThreadProcessId(hwnd, &dwPID);
+
+    hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, dwPID);
+    if (hProcess == NULL)
+        hProcess = OpenProcess(PROCESS_QUERY_INFORMATION, FALSE, dwPID);
+    if (hProcess == NULL)
+        return FALSE;
+
+    szPath[0] = 0;
+    if (!GetProcessImageFileName(hProcess, szPath, _countof(szPath)))
+    {
+        CloseHandle(hProcess);
+        return FALSE;
+    }
+    CloseHandle(hProcess);
+
+    pch = _tcsrchr(szPath, _T('\\'));
+    StringCchCopy(pszName, cchName, (pch ? pch + 1 : szPath));
+    CharLower(pszName);
+    return pszName[0] != 0;
+}
+
+// Finds the installed layout of a KLID.
+// Called from both threads. The installed layouts are in even a lazy catalog.
+static HKL GetInstalledLayout(DWORD dwKLID)
+{
+    HKL ahKLs[256];
+    UINT iKL, cKLs;
+    INT iEntry;
+    BOOL bMatch;
+
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        if (IS_IME_HKL(ahKLs[iKL]))
+        {
+            if ((DWORD)(DWORD_PTR)ahKLs[iKL] == dwKLID)
+                return ahKLs[iKL];
+            continue;
+        }
+
+        bMatch = FALSE;
+        if (g_bCatalogReady)
+        {
+            EnterCriticalSection(&g_csCatalog);
+            iEntry = ScanLayoutEntries(ahKLs[iKL]);
+            bMatch = (iEntry != -1 && g_pLayouts[iEntry].dwKLID == dwKLID);
+            LeaveCriticalSection(&g_csCatalog);
+        }
+        if (bMatch)
+            return ahKLs[iKL];
+
+        if (!IS_VARIANT_HKL(ahKLs[iKL]) && HIWORD(dwKLID) == 0 &&
+            HIWORD(ahKLs[iKL]) == LOWORD(dwKLID))
+        {
+            return ahKLs[iKL];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the layout the policy wants on hwndTarget, or NULL.
+// No rules apply before the catalog is ready; see OnCatalogLoaded.
+static HKL MatchLayoutPolicy(HWND hwndTarget)
+{
+    TCHAR szClass[MAX_PATH], szProcess[MAX_PATH], szTitle[MAX_PATH];
+    DWORD dwClassHash, dwProcessHash = 0;
+    BOOL bHasTitle = FALSE;
+    PLAYOUT_RULE pRule;
+    UINT aiNext[3], iList, i;
+
+    if (!g_bCatalogReady || g_cRules == 0)
+        return NULL;
+
+    if (!GetClassName(hwndTarget, szClass, _countof(szClass)))
+        return NULL;
+    CharLower(szClass);
+    dwClassHash = HashString(szClass);
+
+    if (g_bRulesNeedProcess && GetWindowProcessName(hwndTarget, szProcess, _countof(szProcess)))
+        dwProcessHash = HashString(szProcess);
+
+    aiNext[0] = g_aiClassRules[dwClassHash & (RULE_BUCKETS - 1)];
+    aiNext[1] = dwProcessHash ? g_aiProcessRules[dwProcessHash & (RULE_BUCKETS - 1)] : RULE_NONE;
+    aiNext[2] = g_iOtherRules;
+
+    for (;;)
+    {
+        /* The first rule of the three lists, to keep the order of the rules */
+        iList = 0;
+        if (aiNext[1] < aiNext[iList])
+            iList = 1;
+        if (aiNext[2] < aiNext[iList])
+            iList = 2;
+
+        i = aiNext[iList];
+        if (i == RULE_NONE)
+            break;
+
+        pRule = &g_pRules[i];
+        aiNext[iList] = pRule->iNext;
+
+        if (pRule->dwClassHash &&
+            (pRule->dwClassHash != dwClassHash || _tcscmp(pRule->pszClass, szClass) != 0))
+        {
+            continue;
+        }
+
+        if (pRule->dwProcessHash &&
+            (pRule->dwProcessHash != dwProcessHash || _tcscmp(pRule->pszProcess, szProcess) != 0))
+        {
+            continue;
+        }
+
+        if (pRule->pszTitle)
+        {
+            if (!bHasTitle)
+            {
+                GetWndText(hwndTarget, szTitle, _countof(szTitle));
+                CharLower(szTitle);
+                bHasTitle = TRUE;
+            }
+            if (!WildcardMatch(pRule->pszTitle, szTitle))
+                continue;
+        }
+
+        return GetInstalledLayout(pRule->dwKLID);
+    }
+
+    return NULL;
+}
+
+/*
+ * Persistent per-application layout memory.
+ *
+ * The last layout of each application (identified by the hash of its image file
+ * name) is appended to %APPDATA%\kbswitch\AppLayouts.dat as a fixed-size,
+ * checksummed record. At startup the log is mapped and replayed into an open
+ * addressing hash table; a torn record at the end (e.g. after a crash) and
+ * anything after it is cut off. Once the log has grown past a bound and holds
+ * mostly superseded records, it is rewritten with one record per application
+ * and atomically replaced. The catalog loader thread loads the log and compacts
+ * it at startup; then the thread that handles the events appends to it, and
+ * when an append crosses the bound, a worker thread writes the compacted log
+ * from a copy of the table. The next append (or CloseAppStore) adds the records
+ * appended meanwhile and replaces the log.
+ *
+ * Enabled by the "RememberAppLayouts" DWORD setting.
+ */
+#define APP_STORE_MAGIC         0x594C414B // "KALY"
+#define APP_STORE_VERSION       1
+#define APP_STORE_COMPACT_SIZE  (64 * 1024)
+
+typedef struct tagAPP_STORE_HEADER
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+} APP_STORE_HEADER;
+
+typedef struct tagAPP_LAYOUT_RECORD
+{
+    DWORD dwAppHash;
+    DWORD dwHKL;
+    DWORD dwCheckSum;
+} APP_LAYOUT_RECORD, *PAPP_LAYOUT_RECORD;
+
+typedef struct tagAPP_LAYOUT_SLOT
+{
+    DWORD dwAppHash; // 0 if empty
+    DWORD dwHKL;
+} APP_LAYOUT_SLOT, *PAPP_LAYOUT_SLOT;
+
+BOOL g_bRememberAppLayouts = FALSE;
+PAPP_LAYOUT_SLOT g_pAppSlots = NULL; // LocalAlloc'ed
+UINT g_cAppSlots = 0, g_cAppEntries = 0; // g_cAppSlots is a power of two
+HANDLE g_hAppStore = INVALID_HANDLE_VALUE; // Opened for appending
+DWORD g_cbAppStore = 0, g_cAppRecords = 0; // The size of the log and the records in it
+
+typedef struct tagAPP_STORE_COMPACTION
+{
+    HANDLE hThread; // NULL if no compaction is running
+    PAPP_LAYOUT_SLOT pSlots; // A copy of the table
+    UINT cSlots;
+    DWORD cbLog; // The size of the log when the table was copied
+    DWORD cbNextTry; // A failed compaction is not retried before the log reaches this size
+    TCHAR szTempPath[MAX_PATH];
+} APP_STORE_COMPACTION;
+
+APP_STORE_COMPACTION g_AppStoreCompaction = { NULL };
+
+static DWORD GetSettingDword(LPCTSTR pszName, DWORD dwDefault)
+{
+    HKEY hKey;
+    DWORD dwValue = dwDefault, cb = sizeof(dwValue), dwType;
+
+    if (RegOpenKeyEx(HKEY_CURRENT_USER, KBSWITCH_REG_KEY, 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+        return dwDefault;
+
+    if (RegQueryValueEx(hKey, pszName, NULL, &dwType, (LPBYTE)&dwValue, &cb) != ERROR_SUCCESS ||
+        dwType != REG_DWORD)
+    {
+        dwValue = dwDefault;
+    }
+
+    RegCloseKey(hKey);
+    return dwValue;
+}
+
+// The settings that take effect without a restart
+static VOID LoadRuntimeSettings(VOID)
+{
+    g_dwLayoutCacheTTL = GetSettingDword(TEXT("LayoutCacheTTL"), 5000);
+    g_bGlobalMode = GetSettingDword(TEXT("GlobalMode"), FALSE);
+    g_dwGlobalModeInterval = GetSettingDword(TEXT("GlobalModeInterval"), 200);
+}
+
+static DWORD GetAppRecordCheckSum(DWORD dwAppHash, DWORD dwHKL)
+{
+    DWORD dwSum = (dwAppHash ^ 0x9E3779B9) * 0x85EBCA6B;
+    dwSum ^= dwHKL + 0xC2B2AE35 + (dwSum << 6) + (dwSum >> 2);
+    return dwSum ^ (dwSum >> 16);
+}
+
+static PAPP_LAYOUT_SLOT FindAppSlot(PAPP_LAYOUT_SLOT pSlots, UINT cSlots, DWORD dwAppHash)
+{
+    UINT i = dwAppHash & (cSlots - 1);
+
+    while (pSlots[i].dwAppHash && pSlots[i].dwAppHash != dwAppHash)
+        i = (i + 1) & (cSlots - 1);
+
+    return &pSlots[i];
+}
+
+static BOOL SetAppSlot(DWORD dwAppHash, DWORD dwHKL)
+{
+    PAPP_LAYOUT_SLOT pSlots, pSlot;
+    UINT i, cSlots;
+
+    if ((g_cAppEntries + 1) * 4 > g_cAppSlots * 3)
+    {
+        cSlots = g_cAppSlots ? g_cAppSlots * 2 : 256;
+        pSlots = LocalAlloc(LPTR, cSlots * sizeof(APP_LAYOUT_SLOT));
+        if (pSlots == NULL)
+            return FALSE;
+
+        for (i = 0; i < g_cAppSlots; ++i)
+        {
+            if (g_pAppSlots[i].dwAppHash)
+                *FindAppSlot(pSlots, cSlots, g_pAppSlots[i].dwAppHash) = g_pAppSlots[i];
+        }
+
+        LocalFree(g_pAppSlots);
+        g_pAppSlots = pSlots;
+        g_cAppSlots = cSlots;
+    }
+
+    pSlot = FindAppSlot(g_pAppSlots, g_cAppSlots, dwAppHash);
+    if (!pSlot->dwAppHash)
+        ++g_cAppEntries;
+    pSlot->dwAppHash = dwAppHash;
+    pSlot->dwHKL = dwHKL;
+    return TRUE;
+}
+
+static BOOL GetAppStorePath(LPTSTR pszPath, LPCTSTR pszFileName)
+{
+    if (FAILED(SHGetFolderPath(NULL, CSIDL_APPDATA | CSIDL_FLAG_CREATE, NULL, 0, pszPath)))
+        return FALSE;
+
+    StringCchCat(pszPath, MAX_PATH, TEXT("\\kbswitch"));
+    CreateDirectory(pszPath, NULL);
+    StringCchCat(pszPath, MAX_PATH, TEXT("\\"));
+    StringCchCat(pszPath, MAX_PATH, pszFileName);
+    return TRUE;
+}
+
+static BOOL WriteAppStoreHeader(HANDLE hFile)
+{
+    APP_STORE_HEADER Header = { APP_STORE_MAGIC, APP_STORE_VERSION };
+    DWORD cbWritten;
+    return WriteFile(hFile, &Header, sizeof(Header), &cbWritten, NULL) && cbWritten == sizeof(Header);
+}
+
+// Whether the log holds mostly superseded records
+static BOOL IsAppStoreBloated(DWORD cbLog, DWORD cRecords)
+{
+    return cbLog > APP_STORE_COMPACT_SIZE && cRecords > g_cAppEntries * 2;
+}
+
+// Writes a log with one record per application to pszTempPath.
+static BOOL WriteAppStoreSlots(LPCTSTR pszTempPath, const APP_LAYOUT_SLOT *pSlots, UINT cSlots)
+{
+    APP_LAYOUT_RECORD Record;
+    HANDLE hFile;
+    DWORD cbWritten;
+    BOOL bOK;
+    UINT i;
+
+    hFile = CreateFile(pszTempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    bOK = WriteAppStoreHeader(hFile);
+    for (i = 0; bOK && i < cSlots; ++i)
+    {
+        if (!pSlots[i].dwAppHash)
+            continue;
+
+        Record.dwAppHash = pSlots[i].dwAppHash;
+        Record.dwHKL = pSlots[i].dwHKL;
+        Record.dwCheckSum = GetAppRecordCheckSum(Record.dwAppHash, Record.dwHKL);
+        bOK = WriteFile(hFile, &Record, sizeof(Record), &cbWritten, NULL) &&
+              cbWritten == sizeof(Record);
+    }
+
+    bOK = bOK && FlushFileBuffers(hFile);
+    CloseHandle(hFile);
+
+    if (!bOK)
+        DeleteFile(pszTempPath);
+    return bOK;
+}
+
+// Rewrites the log with one record per application.
+static VOID CompactAppStore(LPCTSTR pszPath)
+{
+    TCHAR szTempPath[MAX_PATH];
+
+    if (!GetAppStorePath(szTempPath, TEXT("AppLayouts.tmp")) ||
+        !WriteAppStoreSlots(szTempPath, g_pAppSlots, g_cAppSlots))
+    {
+        return;
+    }
+
+    if (!MoveFileEx(szTempPath, pszPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        DeleteFile(szTempPath);
+}
+
+static DWORD WINAPI AppStoreCompactionProc(LPVOID lpParameter)
+{
+    APP_STORE_COMPACTION *pCompaction = (APP_STORE_COMPACTION *)lpParameter;
+    return WriteAppStoreSlots(pCompaction->szTempPath, pCompaction->pSlots, pCompaction->cSlots);
+}
+
+// Starts to compact the log on a worker thread, unless it is already being compacted.
+static VOID StartAppStoreCompaction(VOID)
+{
+    APP_STORE_COMPACTION *pCompaction = &g_AppStoreCompaction;
+
+    if (pCompaction->hThread || g_cbAppStore < pCompaction->cbNextTry ||
+        !GetAppStorePath(pCompaction->szTempPath, TEXT("AppLayouts.tmp")))
+    {
+        return;
+    }
+    pCompaction->cbNextTry = g_cbAppStore + APP_STORE_COMPACT_SIZE;
+
+    pCompaction->pSlots = LocalAlloc(LMEM_FIXED, g_cAppSlots * sizeof(APP_LAYOUT_SLOT));
+    if (pCompaction->pSlots == NULL)
+        return;
+    CopyMemory(pCompaction->pSlots, g_pAppSlots, g_cAppSlots * sizeof(APP_LAYOUT_SLOT));
+    pCompaction->cSlots = g_cAppSlots;
+    pCompaction->cbLog = g_cbAppStore;
+
+    pCompaction->hThread = CreateThread(NULL, 0, AppStoreCompactionProc, pCompaction, 0, NULL);
+    if (pCompaction->hThread == NULL)
+    {
+        LocalFree(pCompaction->pSlots);
+        pCompaction->pSlots = NULL;
+    }
+}
+
+// Appends the records that were appended to the log after the table was copied.
+static BOOL CopyAppStoreTail(LPCTSTR pszTempPath, DWORD cbFrom)
+{
+    APP_LAYOUT_RECORD aRecords[64];
+    HANDLE hFile;
+    DWORD cb, cbRead, cbWritten;
+    BOOL bOK = TRUE;
+
+    hFile = CreateFile(pszTempPath, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    SetFilePointer(hFile, 0, NULL, FILE_END);
+    SetFilePointer(g_hAppStore, cbFrom, NULL, FILE_BEGIN);
+    while (bOK && cbFrom < g_cbAppStore)
+    {
+        cb = min(g_cbAppStore - cbFrom, sizeof(aRecords));
+        bOK = ReadFile(g_hAppStore, aRecords, cb, &cbRead, NULL) && cbRead == cb &&
+              WriteFile(hFile, aRecords, cb, &cbWritten, NULL) && cbWritten == cb;
+        cbFrom += cb;
+    }
+
+    bOK = bOK && FlushFileBuffers(hFile);
+    CloseHandle(hFile);
+    return bOK;
+}
+
+// Replaces the log by the compacted one once the worker has written it.
+static VOID FinishAppStoreCompaction(BOOL bWait)
+{
+    APP_STORE_COMPACTION *pCompaction = &g_AppStoreCompaction;
+    TCHAR szPath[MAX_PATH];
+    DWORD dwExitCode = FALSE, cbFile;
+    HANDLE hFile;
+
+    if (pCompaction->hThread == NULL ||
+        WaitForSingleObject(pCompaction->hThread, bWait ? INFINITE : 0) != WAIT_OBJECT_0)
+    {
+        return;
+    }
+
+    GetExitCodeThread(pCompaction->hThread, &dwExitCode);
+    CloseHandle(pCompaction->hThread);
+    pCompaction->hThread = NULL;
+    LocalFree(pCompaction->pSlots);
+    pCompaction->pSlots = NULL;
+
+    if (!dwExitCode)
+        return;
+
+    if (g_hAppStore == INVALID_HANDLE_VALUE || !GetAppStorePath(szPath, TEXT("AppLayouts.dat")) ||
+        !CopyAppStoreTail(pCompaction->szTempPath, pCompaction->cbLog))
+    {
+        DeleteFile(pCompaction->szTempPath);
+        return;
+    }
+
+    CloseHandle(g_hAppStore);
+    if (MoveFileEx(pCompaction->szTempPath, szPath,
+                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        pCompaction->cbNextTry = 0;
+    }
+    else
+    {
+        DeleteFile(pCompaction->szTempPath);
+    }
+
+    /* Either log holds every layout remembered so far */
+    hFile = CreateFile(szPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    cbFile = (hFile != INVALID_HANDLE_VALUE) ? GetFileSize(hFile, NULL) : INVALID_FILE_SIZE;
+    if (cbFile == INVALID_FILE_SIZE || cbFile < sizeof(APP_STORE_HEADER))
+    {
+        if (hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(hFile);
+        g_hAppStore = INVALID_HANDLE_VALUE;
+        return;
+    }
+
+    g_hAppStore = hFile;
+    g_cAppRecords = (cbFile - sizeof(APP_STORE_HEADER)) / sizeof(APP_LAYOUT_RECORD);
+    g_cbAppStore = sizeof(APP_STORE_HEADER) + g_cAppRecords * sizeof(APP_LAYOUT_RECORD);
+    TRACE("FinishAppStoreCompaction: %lu records\n", g_cAppRecords);
+}
+
+// Replays the log into the hash table. Returns the size of the valid part.
+static DWORD ReplayAppStore(HANDLE hFile, PDWORD pcRecords)
+{
+    HANDLE hMapping;
+    const BYTE *pbView;
+    const APP_STORE_HEADER *pHeader;
+    const APP_LAYOUT_RECORD *pRecord;
+    DWORD cbFile, ib;
+
+    *pcRecords = 0;
+
+    cbFile = GetFileSize(hFile, NULL);
+    if (cbFile == INVALID_FILE_SIZE || cbFile < sizeof(APP_STORE_HEADER))
+        return 0;
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+        return 0;
+
+    pbView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if (pbView == NULL)
+        return 0;
+
+    pHeader = (const APP_STORE_HEADER *)pbView;
+    if (pHeader->dwMagic != APP_STORE_MAGIC || pHeader->dwVersion != APP_STORE_VERSION)
+    {
+        UnmapViewOfFile(pbView);
+        return 0;
+    }
+
+    for (ib = sizeof(APP_STORE_HEADER); ib + sizeof(APP_LAYOUT_RECORD) <= cbFile;
+         ib += sizeof(APP_LAYOUT_RECORD))
+    {
+        pRecord = (const APP_LAYOUT_RECORD *)(pbView + ib);
+        if (!pRecord->dwAppHash ||
+            pRecord->dwCheckSum != GetAppRecordCheckSum(pRecord->dwAppHash, pRecord->dwHKL))
+        {
+            break;
+        }
+
+        SetAppSlot(pRecord->dwAppHash, pRecord->dwHKL);
+        ++*pcRecords;
+    }
+
+    UnmapViewOfFile(pbView);
+    return ib;
+}
+
+static VOID LoadAppStore(VOID)
+{
+    TCHAR szPath[MAX_PATH];
+    HANDLE hFile;
+    DWORD cbValid, cRecords;
+
+    g_bRememberAppLayouts = GetSettingDword(TEXT("RememberAppLayouts"), FALSE);
+    if (!g_bRememberAppLayouts || !GetAppStorePath(szPath, TEXT("AppLayouts.dat")))
+        return;
+
+    hFile = CreateFile(szPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                       OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    cbValid = ReplayAppStore(hFile, &cRecords);
+
+    if (IsAppStoreBloated(cbValid, cRecords))
+    {
+        CloseHandle(hFile);
+        CompactAppStore(szPath);
+
+        hFile = CreateFile(szPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                           OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return;
+        cbValid = ReplayAppStore(hFile, &cRecords);
+    }
+
+    /* Cut off a torn tail, or start a new log */
+    SetFilePointer(hFile, cbValid, NULL, FILE_BEGIN);
+    SetEndOfFile(hFile);
+    if (cbValid == 0)
+    {
+        if (!WriteAppStoreHeader(hFile))
+        {
+            CloseHandle(hFile);
+            return;
+        }
+        cbValid = sizeof(APP_STORE_HEADER);
+    }
+
+    g_hAppStore = hFile;
+    g_cbAppStore = cbValid;
+    g_cAppRecords = cRecords;
+    TRACE("LoadAppStore: %u applications, %lu records\n", g_cAppEntries, cRecords);
+}
+
+static VOID CloseAppStore(VOID)
+{
+    FinishAppStoreCompaction(TRUE);
+
+    if (g_hAppStore != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(g_hAppStore);
+        g_hAppStore = INVALID_HANDLE_VALUE;
+    }
+
+    LocalFree(g_pAppSlots);
+    g_pAppSlots = NULL;
+    g_cAppSlots = g_cAppEntries = 0;
+}
+
+static DWORD GetWindowAppHash(HWND hwndTarget)
+{
+    TCHAR szProcess[MAX_PATH];
+
+    if (!GetWindowProcessName(hwndTarget, szProcess, _countof(szProcess)))
+        return 0;
+
+    return HashString(szProcess);
+}
+
+static VOID RememberAppLayout(HWND hwndTarget, HKL hKL)
+{
+    APP_LAYOUT_RECORD Record;
+    PAPP_LAYOUT_SLOT pSlot;
+    DWORD cbWritten;
+
+    /* The store belongs to the loader thread until the catalog is ready */
+    if (!g_bCatalogReady || g_hAppStore == INVALID_HANDLE_VALUE)
+        return;
+
+    Record.dwAppHash = GetWindowAppHash(hwndTarget);
+    Record.dwHKL = (DWORD)(DWORD_PTR)hKL;
+    if (!Record.dwAppHash)
+        return;
+
+    pSlot = FindAppSlot(g_pAppSlots, g_cAppSlots, Record.dwAppHash);
+    if (pSlot->dwAppHash && pSlot->dwHKL == Record.dwHKL)
+        return;
+
+    if (!SetAppSlot(Record.dwAppHash, Record.dwHKL))
+        return;
+
+    Record.dwCheckSum = GetAppRecordCheckSum(Record.dwAppHash, Record.dwHKL);
+    SetFilePointer(g_hAppStore, g_cbAppStore, NULL, FILE_BEGIN);
+    if (!WriteFile(g_hAppStore, &Record, sizeof(Record), &cbWritten, NULL) ||
+        cbWritten != sizeof(Record))
+    {
+        return;
+    }
+    g_cbAppStore += sizeof(Record);
+    ++g_cAppRecords;
+
+    FinishAppStoreCompaction(FALSE);
+    if (g_hAppStore != INVALID_HANDLE_VALUE && IsAppStoreBloated(g_cbAppStore, g_cAppRecords))
+        StartAppStoreCompaction();
+}
+
+static HKL RecallAppLayout(HWND hwndTarget)
+{
+    PAPP_LAYOUT_SLOT pSlot;
+    DWORD dwAppHash;
+    HKL hKL, ahKLs[256];
+    UINT iKL, cKLs;
+
+    if (!g_bCatalogReady || g_cAppEntries == 0)
+        return NULL;
+
+    dwAppHash = GetWindowAppHash(hwndTarget);
+    if (!dwAppHash)
+        return NULL;
+
+    pSlot = FindAppSlot(g_pAppSlots, g_cAppSlots, dwAppHash);
+    if (!pSlot->dwAppHash)
+        return NULL;
+
+    /* HKLs are sign-extended on 64-bit Windows */
+    hKL = (HKL)(LONG_PTR)(LONG)pSlot->dwHKL;
+
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        if (ahKLs[iKL] == hKL)
+            return hKL;
+    }
+
+    return NULL;
+}
+
+// Switches hwndTarget to the layout of the policy. Returns the resulting layout.
+static HKL ApplyLayoutPolicy(HWND hwnd, HWND hwndTarget, HKL hKL)
+{
+    HKL hPolicyKL;
+
+    if (g_bGlobalMode)
+    {
+        hPolicyKL = g_hGlobalKL;
+    }
+    else
+    {
+        hPolicyKL = MatchLayoutPolicy(hwndTarget);
+        if (hPolicyKL == NULL)
+            hPolicyKL = RecallAppLayout(hwndTarget);
+    }
+    if (hPolicyKL == NULL || hPolicyKL == hKL)
+        return hKL;
+
+    TRACE("ApplyLayoutPolicy: %p --> %p\n", hKL, hPolicyKL);
+    SetLastActive(hwndTarget, __LINE__);
+    ChooseLayout(hwnd, hPolicyKL);
+    return hPolicyKL;
+}
+
+/*
+ * The control channel.
+ *
+ * A named pipe (\\.\pipe\kbswitch.<session ID>) accepting KBSCTL_REQUESTs and
+ * answering each with a KBSCTL_RESPONSE and its data, in order, so that clients
+ * can pipeline requests. The pipe is served by its own thread with overlapped
+ * I/O; each request is handed to the UI thread with WM_CONTROLREQUEST so that it
+ * sees and changes the state just like the tray menu does.
+ */
+typedef struct tagCONTROL_REPLY
+{
+    KBSCTL_RESPONSE Response;
+    LPVOID pvData; // LocalAlloc'ed
+} CONTROL_REPLY, *PCONTROL_REPLY;
+
+HANDLE g_hControlThread = NULL;
+HANDLE g_hControlExitEvent = NULL;
+
+// Reads or writes the whole buffer. Fails if the exit event is signaled.
+static BOOL ControlPipeIo(HANDLE hPipe, HANDLE hEvent, BOOL bWrite, LPVOID pv, DWORD cb)
+{
+    OVERLAPPED ov;
+    HANDLE ahWait[2] = { hEvent, g_hControlExitEvent };
+    DWORD cbDone;
+    BOOL bOK;
+
+    while (cb > 0)
+    {
+        ZeroMemory(&ov, sizeof(ov));
+        ov.hEvent = hEvent;
+
+        if (bWrite)
+            bOK = WriteFile(hPipe, pv, cb, NULL, &ov);
+        else
+            bOK = ReadFile(hPipe, pv, cb, NULL, &ov);
+
+        if (!bOK && GetLastError() != ERROR_IO_PENDING)
+            return FALSE;
+
+        if (WaitForMultipleObjects(2, ahWait, FALSE, INFINITE) != WAIT_OBJECT_0)
+        {
+            CancelIo(hPipe);
+            GetOverlappedResult(hPipe, &ov, &cbDone, TRUE);
+            return FALSE;
+        }
+
+        if (!GetOverlappedResult(hPipe, &ov, &cbDone, FALSE) || cbDone == 0)
+            return FALSE;
+
+        pv = (LPBYTE)pv + cbDone;
+        cb -= cbDone;
+    }
+
+    return TRUE;
+}
+
+static BOOL ConnectControlPipe(HANDLE hPipe, HANDLE hEvent)
+{
+    OVERLAPPED ov;
+    HANDLE ahWait[2] = { hEvent, g_hControlExitEvent };
+    DWORD cbDone;
+
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = hEvent;
+
+    if (ConnectNamedPipe(hPipe, &ov))
+        return TRUE;
+
+    switch (GetLastError())
+    {
+        case ERROR_PIPE_CONNECTED:
+            return TRUE;
+
+        case ERROR_IO_PENDING:
+            if (WaitForMultipleObjects(2, ahWait, FALSE, INFINITE) == WAIT_OBJECT_0)
+                return GetOverlappedResult(hPipe, &ov, &cbDone, FALSE);
+
+            CancelIo(hPipe);
+            GetOverlappedResult(hPipe, &ov, &cbDone, TRUE);
+            return FALSE;
+
+        default:
+            return FALSE;
+    }
+}
+
+static DWORD WINAPI ControlThreadProc(LPVOID lpParameter)
+{
+    HWND hwnd = (HWND)lpParameter;
+    TCHAR szPipeName[MAX_PATH];
+    DWORD dwSessionId = 0;
+    HANDLE hPipe, hEvent;
+    KBSCTL_REQUEST Request;
+    CONTROL_REPLY Reply;
+    KBS_USER_SECURITY Security;
+    BOOL bOK;
+
+    hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (hEvent == NULL)
+        return 1;
+
+    ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId);
+    StringCchPrintf(szPipeName, _countof(szPipeName), KBSCTL_PIPE_FORMAT, dwSessionId);
+
+    /*
+     * The one instance of the pipe, kept for all the clients in turn, and open
+     * to this user alone. The name is never released while kbswitch runs, so no
+     * other process can create an instance of it to impersonate kbswitch. If
+     * one already has, kbswitch runs without the channel; kbsctl checks whom it
+     * talks to.
+     */
+    hPipe = CreateNamedPipe(szPipeName,
+                            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                            PIPE_REJECT_REMOTE_CLIENTS,
+                            1, 4096, 4096, 0, KbsInitUserSecurity(&Security));
+    if (hPipe == INVALID_HANDLE_VALUE)
+    {
+        TRACE("Control pipe %s unavailable: %lu\n", szPipeName, GetLastError());
+        CloseHandle(hEvent);
+        return 1;
+    }
+
+    while (WaitForSingleObject(g_hControlExitEvent, 0) == WAIT_TIMEOUT)
+    {
+        if (ConnectControlPipe(hPipe, hEvent))
+        {
+            while (ControlPipeIo(hPipe, hEvent, FALSE, &Request, sizeof(Request)))
+            {
+                ZeroMemory(&Reply, sizeof(Reply));
+                Reply.Response.dwCommand = Request.dwCommand;
+                Reply.Response.dwStatus = ERROR_INVALID_FUNCTION;
+                SendMessage(hwnd, WM_CONTROLREQUEST, (WPARAM)&Request, (LPARAM)&Reply);
+
+                bOK = ControlPipeIo(hPipe, hEvent, TRUE, &Reply.Response, sizeof(Reply.Response)) &&
+                      ControlPipeIo(hPipe, hEvent, TRUE, Reply.pvData, Reply.Response.cbData);
+                LocalFree(Reply.pvData);
+                if (!bOK)
+                    break;
+            }
+        }
+        else if (GetLastError() != ERROR_NO_DATA)
+        {
+            break; // Exiting, or the pipe is broken
+        }
+
+        DisconnectNamedPipe(hPipe);
+    }
+
+    CloseHandle(hPipe);
+    CloseHandle(hEvent);
+    return 0;
+}
+
+static VOID StartControlServer(HWND hwnd)
+{
+    g_hControlExitEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (g_hControlExitEvent == NULL)
+        return;
+
+    g_hControlThread = CreateThread(NULL, 0, ControlThreadProc, hwnd, 0, NULL);
+    if (g_hControlThread == NULL)
+    {
+        CloseHandle(g_hControlExitEvent);
+        g_hControlExitEvent = NULL;
+    }
+}
+
+static VOID StopControlServer(VOID)
+{
+    MSG msg;
+
+    if (g_hControlThread == NULL)
+        return;
+
+    SetEvent(g_hControlExitEvent);
+
+    /* The thread may be sending us a request */
+    while (MsgWaitForMultipleObjects(1, &g_hControlThread, FALSE, INFINITE, QS_SENDMESSAGE) ==
+           WAIT_OBJECT_0 + 1)
+    {
+        PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+    }
+
+    CloseHandle(g_hControlThread);
+    g_hControlThread = NULL;
+    CloseHandle(g_hControlExitEvent);
+    g_hControlExitEvent = NULL;
+}
+
+static LPVOID AllocReplyData(PCONTROL_REPLY pReply, DWORD cbData)
+{
+    pReply->pvData = LocalAlloc(LPTR, cbData);
+    if (pReply->pvData == NULL)
+    {
+        pReply->Response.dwStatus = ERROR_OUTOFMEMORY;
+        return NULL;
+    }
+
+    pReply->Response.cbData = cbData;
+    return pReply->pvData;
+}
+
+static VOID OnControlRequest(HWND hwnd, const KBSCTL_REQUEST *pRequest, PCONTROL_REPLY pReply)
+{
+    PKBSCTL_STATE pState;
+    PKBSCTL_LAYOUT pLayout;
+    PKBSCTL_SPAN pSpans;
+    TCHAR szKLID[CCH_LAYOUT_ID + 1];
+    INT iEntry;
+    UINT i;
+    HKL hKL;
+
+    switch (pRequest->dwCommand)
+    {
+        case KBSCTL_GET_STATE:
+        {
+            pState = AllocReplyData(pReply, sizeof(KBSCTL_STATE));
+            if (pState == NULL)
+                break;
+
+            iEntry = FindLayoutEntry(g_hKL);
+            pState->qwHKL = (DWORD64)(LONG_PTR)g_hKL;
+            pState->qwLastActive = (DWORD64)(LONG_PTR)g_hwndLastActive;
+            pState->dwKLID = (iEntry != -1) ? g_pLayouts[iEntry].dwKLID : 0;
+            pReply->Response.dwStatus = ERROR_SUCCESS;
+            break;
+        }
+
+        case KBSCTL_SET_LAYOUT:
+        {
+            hKL = GetInstalledLayout(pRequest->dwParam);
+            if (hKL == NULL)
+            {
+                StringCchPrintf(szKLID, _countof(szKLID), TEXT("%08lX"), pRequest->dwParam);
+                hKL = LoadKeyboardLayout(szKLID, 0);
+            }
+
+            if (hKL == NULL || g_hwndLastActive == NULL)
+            {
+                pReply->Response.dwStatus = ERROR_NOT_FOUND;
+                break;
+            }
+
+            PostChooseLayout(hwnd, hKL);
+            g_hKL = hKL;
+            pReply->Response.dwStatus = ERROR_SUCCESS;
+            break;
+        }
+
+        case KBSCTL_LIST_LAYOUTS:
+        {
+            if (!g_bCatalogReady || !EnsureFullCatalog())
+            {
+                pReply->Response.dwStatus = ERROR_NOT_READY;
+                break;
+            }
+
+            pLayout = AllocReplyData(pReply, max(g_cLayouts, 1) * sizeof(KBSCTL_LAYOUT));
+            if (pLayout == NULL)
+                break;
+
+            for (i = 0; i < g_cLayouts; ++i)
+            {
+                pLayout[i].dwKLID = g_pLayouts[i].dwKLID;
+                pLayout[i].dwVariant = g_pLayouts[i].dwVariant;
+#ifdef UNICODE
+                StringCchCopyW(pLayout[i].szText, _countof(pLayout[i].szText), g_pLayouts[i].pszText);
+#else
+                MultiByteToWideChar(CP_ACP, 0, g_pLayouts[i].pszText, -1,
+                                    pLayout[i].szText, _countof(pLayout[i].szText));
+                pLayout[i].szText[_countof(pLayout[i].szText) - 1] = 0;
+#endif
+            }
+            pReply->Response.cbData = g_cLayouts * sizeof(KBSCTL_LAYOUT);
+            pReply->Response.dwStatus = ERROR_SUCCESS;
+            break;
+        }
+
+        case KBSCTL_GET_COUNTERS:
+        {
+            if (AllocReplyData(pReply, sizeof(KBS_COUNTERS)) == NULL)
+                break;
+
+            if (g_fnKbsGetCounters)
+                g_fnKbsGetCounters(&g_Counters.Hook);
+            CopyMemory(pReply->pvData, &g_Counters, sizeof(KBS_COUNTERS));
+            pReply->Response.dwStatus = ERROR_SUCCESS;
+            break;
+        }
+
+        case KBSCTL_GET_HANDLES:
+        {
+            if (AllocReplyData(pReply, sizeof(KBSCTL_HANDLES)) == NULL)
+                break;
+
+            GetHandleCounts(pReply->pvData);
+            pReply->Response.dwStatus = ERROR_SUCCESS;
+            break;
+        }
+
+        case KBSCTL_TRACE:
+        {
+            if (pRequest->dwParam)
+            {
+                StartSpanSession();
+                pReply->Response.dwStatus =
+                    g_dwSpanSession ? ERROR_SUCCESS : ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+
+            i = ExportSpans(NULL, 0);
+            pSpans = AllocReplyData(pReply, max(i, 1) * sizeof(KBSCTL_SPAN));
+            if (pSpans == NULL)
+                break;
+
+            pReply->Response.cbData = ExportSpans(pSpans, i) * sizeof(KBSCTL_SPAN);
+            pReply->Response.dwStatus = ERROR_SUCCESS;
+            break;
+        }
+    }
+}
+
+/*
+ * The polling of the foreground layout.
+ *
+ * Vista+ doesn't tell us about every layout change, so the foreground window is
+ * polled every second. The timer is coalescable where the system supports it,
+ * so that its wakeups are shared with the others, and it is stopped while the
+ * session is locked or disconnected. A tick that finds the same layout as the
+ * tray shows doesn't redraw the icon.
+ */
+typedef UINT_PTR (WINAPI *FN_SET_COALESCABLE_TIMER)(HWND, UINT_PTR, UINT, TIMERPROC, ULONG);
+
+BOOL g_bSessionInactive = FALSE; // Locked or disconnected
+BOOL g_bSessionNotification = FALSE;
+
+static VOID StartPolling(HWND hwnd)
+{
+    static FN_SET_COALESCABLE_TIMER s_fnSetCoalescableTimer = NULL;
+    static BOOL s_bResolved = FALSE;
+
+    if (g_bSessionInactive)
+        return;
+
+    if (!s_bResolved)
+    {
+        s_fnSetCoalescableTimer = (FN_SET_COALESCABLE_TIMER)
+            GetProcAddress(GetModuleHandle(TEXT("user32")), "SetCoalescableTimer");
+        s_bResolved = TRUE;
+    }
+
+    if (!s_fnSetCoalescableTimer ||
+        !s_fnSetCoalescableTimer(hwnd, TIMER_ID, TIMER_INTERVAL, NULL, TIMER_TOLERANCE))
+    {
+        SetTimer(hwnd, TIMER_ID, TIMER_INTERVAL, NULL);
+    }
+}
+
+/*
+ * Staged startup.
+ *
+ * At logon kbswitch competes with everything else on the machine, so the tray
+ * badge is shown first from the current layout alone. The hooks are installed
+ * from the message loop right after that, and the layout catalog is loaded on a
+ * worker thread. Every phase is timed; the timings are traced and, with
+ * "/profile <file>", appended to a file so that logon cost can be tracked.
+ */
+typedef enum tagSTARTUP_PHASE
+{
+    STARTUP_PHASE_TRAY,
+    STARTUP_PHASE_HOOK,
+    STARTUP_PHASE_CATALOG,
+    STARTUP_PHASE_POLICY,
+    STARTUP_PHASE_COUNT
+} STARTUP_PHASE;
+
+typedef struct tagSTARTUP_TIMING
+{
+    LPCSTR pszName;
+    LARGE_INTEGER liBegin, liEnd;
+} STARTUP_TIMING;
+
+STARTUP_TIMING g_StartupTimings[STARTUP_PHASE_COUNT] =
+{
+    { "tray" }, { "hook" }, { "catalog" }, { "policy" }
+};
+LARGE_INTEGER g_liStartup; // When main was entered
+TCHAR g_szStartupProfile[MAX_PATH] = TEXT(""); // "/profile <file>"
+
+static VOID BeginStartupPhase(STARTUP_PHASE iPhase)
+{
+    QueryPerformanceCounter(&g_StartupTimings[iPhase].liBegin);
+}
+
+static VOID EndStartupPhase(STARTUP_PHASE iPhase)
+{
+    QueryPerformanceCounter(&g_StartupTimings[iPhase].liEnd);
+    EndSpan(g_StartupTimings[iPhase].pszName, iPhase, g_StartupTimings[iPhase].liBegin.QuadPart);
+}
+
+// Appends pszLine to the file of "/profile <file>", if any
+static VOID AppendProfileLine(LPCSTR pszLine)
+{
+    HANDLE hFile;
+    DWORD cbWritten;
+
+    if (!g_szStartupProfile[0])
+        return;
+
+    hFile = CreateFile(g_szStartupProfile, FILE_APPEND_DATA, FILE_SHARE_READ, NULL,
+                       OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    WriteFile(hFile, pszLine, lstrlenA(pszLine), &cbWritten, NULL);
+    CloseHandle(hFile);
+}
+
+static VOID DumpStartupProfile(VOID)
+{
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    LARGE_INTEGER liFreq;
+    CHAR szLine[512];
+    double msBegin, msLength;
+    INT iPhase;
+
+    QueryPerformanceFrequency(&liFreq);
+
+    szLine[0] = 0;
+    for (iPhase = 0; iPhase < STARTUP_PHASE_COUNT; ++iPhase)
+    {
+        STARTUP_TIMING *pTiming = &g_StartupTimings[iPhase];
+        msBegin = (pTiming->liBegin.QuadPart - g_liStartup.QuadPart) * 1000.0 / liFreq.QuadPart;
+        msLength = (pTiming->liEnd.QuadPart - pTiming->liBegin.QuadPart) * 1000.0 / liFreq.QuadPart;
+        StringCchPrintfA(szLine + lstrlenA(szLine), _countof(szLine) - lstrlenA(szLine),
+                         "%s%s @%.2f +%.2fms", (iPhase ? ", " : ""), pTiming->pszName,
+                         msBegin, msLength);
+    }
+
+    ZeroMemory(&pmc, sizeof(pmc));
+    pmc.cb = sizeof(pmc);
+    GetProcessMemoryInfo(GetCurrentProcess(), (PPROCESS_MEMORY_COUNTERS)&pmc, sizeof(pmc));
+    StringCchPrintfA(szLine + lstrlenA(szLine), _countof(szLine) - lstrlenA(szLine),
+                     "; %s catalog of %u entries, private %luKB, working set %luKB\r\n",
+                     (g_bCatalogFull ? "full" : "lazy"), g_cLayouts,
+                     (DWORD)(pmc.PrivateUsage / 1024), (DWORD)(pmc.WorkingSetSize / 1024));
+
+    TRACE("Startup: %s", szLine);
+    AppendProfileLine(szLine);
+}
+
+static DWORD WINAPI CatalogThreadProc(LPVOID lpParameter)
+{
+    HWND hwnd = (HWND)lpParameter;
+    BOOL bLoaded;
+
+    BeginStartupPhase(STARTUP_PHASE_CATALOG);
+    g_bLazyCatalog = GetSettingDword(TEXT("LazyCatalog"), FALSE);
+    g_cCatalogThreads = GetSettingDword(TEXT("CatalogThreads"), DEFAULT_CATALOG_THREADS);
+    LoadRuntimeSettings();
+    if (g_bLazyCatalog)
+        bLoaded = LoadInstalledLayouts();
+    else
+        bLoaded = LoadKeyboardLayouts();
+    LoadAppStore();
+    EndStartupPhase(STARTUP_PHASE_CATALOG);
+
+    PostMessage(hwnd, WM_CATALOGLOADED, bLoaded, 0);
+    return 0;
+}
+
+static BOOL OnCreate(HWND hwnd, LPCREATESTRUCT lpCreateStruct)
+{
+    BeginStartupPhase(STARTUP_PHASE_TRAY);
+    g_hwndMain = hwnd;
+    g_hKL = GetKeyboardLayout(0);
+    AddTrayIcon(hwnd, g_hKL);
+    g_uTaskbarRestart = RegisterWindowMessage(TEXT("TaskbarCreated"));
+    EndStartupPhase(STARTUP_PHASE_TRAY);
+
+    PostMessage(hwnd, WM_STARTUPSTAGE, 0, 0);
+    return TRUE;
+}
+
+static VOID InstallHooks(HWND hwnd)
+{
+    BeginStartupPhase(STARTUP_PHASE_HOOK);
+
+    g_hwndTrayWnd = GetTrayWnd();
+    g_dwCodePageBitField = GetCodePageBitField(hwnd);
+
+    if (CreateSnapshot())
+        PublishSnapshot(g_hKL);
+
+    g_hDLL = LoadLibrary(TEXT("kbsdll.dll"));
+    if (g_hDLL)
+    {
+        g_fnKbsHook = (FN_KBS_HOOK)GetProcAddress(g_hDLL, "KbsHook");
+        g_fnKbsUnhook = (FN_KBS_UNHOOK)GetProcAddress(g_hDLL, "KbsUnhook");
+        if (!g_fnKbsHook || !g_fnKbsUnhook)
+        {
+            g_fnKbsHook = NULL;
+            g_fnKbsUnhook = NULL;
+            FreeLibrary(g_hDLL);
+            g_hDLL = NULL;
+        }
+    }
+
+    if (g_hDLL)
+    {
+        // Optional; an older kbsdll posts all the events
+        FN_KBS_SET_EVENT_MASK fnKbsSetEventMask;
+        fnKbsSetEventMask = (FN_KBS_SET_EVENT_MASK)GetProcAddress(g_hDLL, "KbsSetEventMask");
+        if (fnKbsSetEventMask)
+            fnKbsSetEventMask(KBS_EVENT_MASK);
+        g_fnKbsGetCounters = (FN_KBS_GET_COUNTERS)GetProcAddress(g_hDLL, "KbsGetCounters");
+        g_fnKbsActivateLayout =
+            (FN_KBS_ACTIVATE_LAYOUT)GetProcAddress(g_hDLL, "KbsActivateLayout");
+        g_fnKbsCancelActivation =
+            (FN_KBS_CANCEL_ACTIVATION)GetProcAddress(g_hDLL, "KbsCancelActivation");
+        if (!g_fnKbsActivateLayout || !g_fnKbsCancelActivation)
+        {
+            g_fnKbsActivateLayout = NULL;
+            g_fnKbsCancelActivation = NULL;
+        }
+    }
+
+    if (g_fnKbsHook)
+        g_fnKbsHook(g_hwndEvents ? g_hwndEvents : hwnd);
+    g_bSessionNotification = WTSRegisterSessionNotification(hwnd, NOTIFY_FOR_THIS_SESSION);
+    StartPolling(hwnd);
+
+    EndStartupPhase(STARTUP_PHASE_HOOK);
+
+    g_hCatalogThread = CreateThread(NULL, 0, CatalogThreadProc, hwnd, 0, NULL);
+    if (g_hCatalogThread == NULL)
+        CatalogThreadProc(hwnd);
+}
+
+/*
+ * The waits of the UI thread.
+ *
+ * The message loop waits for kernel objects as well as for messages, so that a
+ * handler never has to block: it registers what it waits for with AddUiWait,
+ * returns, and its UI_WAIT_PROC runs on the UI thread when the object is
+ * signaled. A wait fires once; the procedure adds it again to keep waiting.
+ * The waits don't fire while a menu or a dialog runs its own modal loop.
+ */
+#define MAX_UI_WAITS (MAXIMUM_WAIT_OBJECTS - 1)
+
+typedef VOID (*UI_WAIT_PROC)(HWND hwnd, HANDLE hObject);
+
+typedef struct tagUI_WAIT
+{
+    HANDLE hObject;
+    UI_WAIT_PROC fnProc;
+} UI_WAIT;
+
+UI_WAIT g_UiWaits[MAX_UI_WAITS];
+UINT g_cUiWaits = 0;
+
+static BOOL AddUiWait(HANDLE hObject, UI_WAIT_PROC fnProc)
+{
+    if (g_cUiWaits >= MAX_UI_WAITS)
+        return FALSE;
+
+    g_UiWaits[g_cUiWaits].hObject = hObject;
+    g_UiWaits[g_cUiWaits].fnProc = fnProc;
+    ++g_cUiWaits;
+    return TRUE;
+}
+
+static VOID RemoveUiWait(HANDLE hObject)
+{
+    UINT i;
+
+    for (i = 0; i < g_cUiWaits; ++i)
+    {
+        if (g_UiWaits[i].hObject == hObject)
+        {
+            g_UiWaits[i] = g_UiWaits[--g_cUiWaits];
+            return;
+        }
+    }
+}
+
+static INT RunMessageLoop(HWND hwnd)
+{
+    HANDLE ahObjects[MAX_UI_WAITS];
+    UI_WAIT Wait;
+    DWORD dwWait;
+    UINT i;
+    MSG msg;
+
+    for (;;)
+    {
+        for (i = 0; i < g_cUiWaits; ++i)
+            ahObjects[i] = g_UiWaits[i].hObject;
+
+        dwWait = MsgWaitForMultipleObjectsEx(g_cUiWaits, ahObjects, INFINITE, QS_ALLINPUT,
+                                             MWMO_INPUTAVAILABLE);
+        if (dwWait < WAIT_OBJECT_0 + g_cUiWaits)
+        {
+            Wait = g_UiWaits[dwWait - WAIT_OBJECT_0];
+            RemoveUiWait(Wait.hObject);
+            Wait.fnProc(hwnd, Wait.hObject);
+            continue;
+        }
+
+        if (dwWait == WAIT_FAILED)
+        {
+            /* A handle has been closed under us; keep the messages going */
+            g_cUiWaits = 0;
+        }
+
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            if (msg.message == WM_QUIT)
+                return (INT)msg.wParam;
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+}
+
+/*
+ * The settings and the rules of the policy are watched, so that a change takes
+ * effect without a restart. The rules are reloaded on the thread of the events,
+ * which is the one that reads them.
+ */
+HKEY g_hSettingsKey = NULL;
+HANDLE g_hSettingsEvent = NULL;
+
+static BOOL ArmSettingsWatch(VOID)
+{
+    return RegNotifyChangeKeyValue(g_hSettingsKey, TRUE,
+                                   REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET,
+                                   g_hSettingsEvent, TRUE) == ERROR_SUCCESS;
+}
+
+static VOID OnSettingsChanged(HWND hwnd, HANDLE hObject)
+{
+    TRACE("Settings changed\n");
+
+    if (ArmSettingsWatch())
+        AddUiWait(g_hSettingsEvent, OnSettingsChanged);
+
+    LoadRuntimeSettings();
+    if (g_hwndEvents)
+        PostMessage(g_hwndEvents, WM_RELOADPOLICY, 0, 0);
+    else
+        LoadLayoutPolicy();
+}
+
+static VOID StopSettingsWatch(VOID)
+{
+    if (g_hSettingsEvent)
+    {
+        RemoveUiWait(g_hSettingsEvent);
+        CloseHandle(g_hSettingsEvent);
+        g_hSettingsEvent = NULL;
+    }
+    if (g_hSettingsKey)
+    {
+        RegCloseKey(g_hSettingsKey);
+        g_hSettingsKey = NULL;
+    }
+}
+
+static VOID StartSettingsWatch(VOID)
+{
+    if (RegCreateKeyEx(HKEY_CURRENT_USER, KBSWITCH_REG_KEY, 0, NULL, 0, KEY_NOTIFY, NULL,
+                       &g_hSettingsKey, NULL) != ERROR_SUCCESS)
+    {
+        g_hSettingsKey = NULL;
+        return;
+    }
+
+    g_hSettingsEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!g_hSettingsEvent || !ArmSettingsWatch() ||
+        !AddUiWait(g_hSettingsEvent, OnSettingsChanged))
+    {
+        StopSettingsWatch();
+    }
+}
+
+static VOID OnCatalogLoaded(HWND hwnd, BOOL bLoaded)
+{
+    if (!bLoaded)
+    {
+        TRACE("LoadKeyboardLayouts failed\n");
+        DestroyWindow(hwnd);
+        return;
+    }
+
+    /*
+     * MatchLayoutPolicy ignores the rules until the catalog is ready, so this
+     * thread owns them until then; the reloads are done by the event thread.
+     */
+    BeginStartupPhase(STARTUP_PHASE_POLICY);
+    LoadLayoutPolicy();
+    EndStartupPhase(STARTUP_PHASE_POLICY);
+
+    InterlockedExchange((LONG volatile *)&g_bCatalogReady, TRUE);
+    UpdateTrayIcon(hwnd, g_hKL);
+    BuildLayoutIndex();
+
+    StartControlServer(hwnd);
+    StartSettingsWatch();
+
+    DumpStartupProfile();
+}
+
+static void OnTimer(HWND hwnd, UINT id)
+{
+    if (id == ACTIVATE_TIMER_ID)
+    {
+        TRACE("Activation #%lu timed out\n", g_dwActivationSeq);
+        AbandonActivation(hwnd, TRUE);
+        return;
+    }
+
+    if (id == PROPAGATE_TIMER_ID)
+    {
+        OnPropagateTimer(hwnd);
+        return;
+    }
+
+    if (id != TIMER_ID)
+        return;
+
+    HWND hwndTarget = GetForegroundWindow();
+    if (IsWndIgnored(hwndTarget))
+        return;
+
+    SetLastActive(hwndTarget, __LINE__);
+
+    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
+    HKL hKL = GetKeyboardLayout(dwThreadId);
+    if (hKL == NULL)
+    {
+        hKL = RecallWindowHKL(g_hwndEvents ? g_hwndEvents : hwnd, hwndTarget);
+    }
+
+    if (hKL == g_hTrayKL)
+    {
+        PublishSnapshot(hKL); // The window may have changed
+    }
+    else
+    {
+        TRACE("hKL++: %p\n", hKL);
+        UpdateTrayIcon(hwnd, hKL);
+
+        /* The switch may have raised no HSHELL_LANGUAGE; report it as one */
+        if (g_bGlobalMode && hKL != g_hGlobalKL)
+        {
+            PostMessage(g_hwndEvents ? g_hwndEvents : hwnd, WM_LANGUAGE,
+                        (WPARAM)hwndTarget, (LPARAM)hKL);
+        }
+    }
+    g_hKL = hKL;
+}
+
+static void OnSessionChange(HWND hwnd, WPARAM wParam)
+{
+    switch (wParam)
+    {
+        case WTS_SESSION_LOCK:
+        case WTS_CONSOLE_DISCONNECT:
+        case WTS_REMOTE_DISCONNECT:
+            TRACE("Session inactive (%u): polling stopped\n", (UINT)wParam);
+            g_bSessionInactive = TRUE;
+            KillTimer(hwnd, TIMER_ID);
+            break;
+
+        case WTS_SESSION_UNLOCK:
+        case WTS_CONSOLE_CONNECT:
+        case WTS_REMOTE_CONNECT:
+            if (!g_bSessionInactive)
+                break;
+            TRACE("Session active (%u): polling resumed\n", (UINT)wParam);
+            g_bSessionInactive = FALSE;
+            StartPolling(hwnd);
+            OnTimer(hwnd, TIMER_ID);
+            break;
+    }
+}
+
+static BOOL CALLBACK
+RemovePropProc(HWND hwnd, LPCTSTR lpszString, HANDLE hData)
+{
+    RemoveProp(hwnd, lpszString);
+    return TRUE;
+}
+
+static VOID StopEventThread(VOID)
+{
+    MSG msg;
+
+    if (g_hEventThread == NULL)
+        return;
+
+    PostMessage(g_hwndEvents, WM_CLOSE, 0, 0);
+
+    /* The thread may be sending to our windows */
+    while (MsgWaitForMultipleObjects(1, &g_hEventThread, FALSE, INFINITE, QS_SENDMESSAGE) ==
+           WAIT_OBJECT_0 + 1)
+    {
+        PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+    }
+
+    CloseHandle(g_hEventThread);
+    g_hEventThread = NULL;
+    g_hwndEvents = NULL;
+}
+
+static void OnDestroy(HWND hwnd)
+{
+    StopSettingsWatch();
+    StopControlServer();
+    RetractSnapshot();
+
+    KillTimer(hwnd, TIMER_ID);
+    if (g_bSessionNotification)
+    {
+        WTSUnRegisterSessionNotification(hwnd);
+        g_bSessionNotification = FALSE;
+    }
+
+    if (g_hMenu)
+    {
+        DestroyMenu(g_hMenu);
+        g_hMenu = NULL;
+    }
+
+    DeleteTrayIcon(hwnd);
+
+    if (g_hCatalogThread)
+    {
+        WaitForSingleObject(g_hCatalogThread, INFINITE);
+        CloseHandle(g_hCatalogThread);
+        g_hCatalogThread = NULL;
+    }
+
+    if (g_fnKbsUnhook)
+    {
+        g_fnKbsUnhook();
+    }
+
+    /* The event thread abandons its activation and its window properties */
+    StopEventThread();
+    AbandonActivation(hwnd, FALSE);
+
+    if (g_fnKbsGetCounters)
+        g_fnKbsGetCounters(&g_Counters.Hook);
+
+    if (g_hDLL)
+    {
+        FreeLibrary(g_hDLL);
+        g_hDLL = NULL;
+    }
+
+    g_fnKbsHook = NULL;
+    g_fnKbsUnhook = NULL;
+    g_fnKbsGetCounters = NULL;
+    g_fnKbsActivateLayout = NULL;
+    g_fnKbsCancelActivation = NULL;
+
+    EnumProps(hwnd, RemovePropProc);
+
+    TRACE("Events: %lu received, %lu coalesced, %lu dropped, %lu drains, max depth %lu\n",
+          g_Counters.cEventsReceived, g_Counters.cEventsCoalesced, g_Counters.cEventsDropped,
+          g_Counters.cDrains, g_Counters.cMaxQueueDepth);
+    TRACE("Hook: %ld posted, %ld failed, loaded into %ld processes\n",
+          g_Counters.Hook.cPosted, g_Counters.Hook.cPostFailed, g_Counters.Hook.cProcesses);
+    ReportHandles();
+
+    FreeLayoutPolicy();
+    FreeLayoutIndex();
+    CloseAppStore();
+    FreeKeyboardLayouts();
+    CloseSharedCatalog();
+    FreeSpanBuffers();
+
+    PostQuitMessage(0);
+}
+
+static void OnNotifyIcon(HWND hwnd, LPARAM lParam)
+{
+    POINT pt;
+
+    switch (lParam)
+    {
+        case WM_RBUTTONUP:
+        case WM_LBUTTONUP:
+        {
+            KillTimer(hwnd, TIMER_ID);
+
+            GetCursorPos(&pt);
+            SetForegroundWindow(hwnd);
+
+            if (lParam == WM_LBUTTONUP)
+            {
+                /* Rebuild the left popup menu on every click to take care of keyboard layout changes */
+                HKL hKL = ShowKeyboardMenu(hwnd, g_hKL, pt);
+                if (hKL)
+                {
+                    PostChooseLayout(hwnd, hKL);
+                    g_hKL = hKL;
+                }
+            }
+            else
+            {
+                if (!g_hRightPopupMenu)
+                {
+                    g_hMenu = LoadMenu(g_hInstance, MAKEINTRESOURCE(IDR_POPUP));
+                    g_hRightPopupMenu = GetSubMenu(g_hMenu, 0);
+                }
+                TrackPopupMenu(g_hRightPopupMenu, 0, pt.x, pt.y, 0, hwnd, NULL);
+            }
+
+            PostMessage(hwnd, WM_NULL, 0, 0);
+            PostMessage(g_hwndTrayWnd, WM_NULL, 0, 0);
+
+            StartPolling(hwnd);
+            break;
+        }
+    }
+}
+
+static VOID AttachWindowInput(HWND hwndAttach)
+{
+    DWORD dwTID1 = GetWindowThreadProcessId(g_hwndTrayWnd, NULL);
+    DWORD dwTID2 = GetWindowThreadProcessId(hwndAttach, NULL);
+    if (!AttachThreadInput(dwTID2, dwTID1, TRUE))
+        MessageBeep(0);
+}
+
+static HKL GetNextLayout(void)
+{
+    HKL ahKLs[256];
+    UINT iKL, cKLs;
+
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        if (g_hKL == ahKLs[iKL])
+        {
+            return ahKLs[(iKL + 1) % cKLs];
+        }
+    }
 
-static DWORD GetCodePageBitField(HWND hwnd)
-{
-    CHARSETINFO CharSet;
-    HDC hDC = GetDC(hwnd);
-    UINT uCharSet = GetTextCharset(hDC);
-    TranslateCharsetInfo((LPDWORD)(UINT_PTR)uCharSet, &CharSet, TCI_SRCCHARSET);
-    ReleaseDC(hwnd, hDC);
-    return CharSet.fs.fsCsb[0];
+    return NULL;
 }
 
-static BOOL IsHKLCharSetSupported(HKL hKL)
+/*
+ * The type-to-filter layout picker.
+ *
+ * Lists the installed layouts first, then the rest of the catalog, and narrows
+ * the list down as the user types. The arrow keys in the filter box move the
+ * selection in the list.
+ */
+#define PICKER_MAX_RANK 3
+
+typedef struct tagPICKER_DATA
 {
-    LOCALESIGNATURE Signature;
-    if (!GetLocaleInfoW(LOWORD(hKL), LOCALE_FONTSIGNATURE, (LPWSTR)&Signature, sizeof(Signature)))
-        return FALSE;
-    return !!(Signature.lsCsbSupported[0] & g_dwCodePageBitField);
-}
+    BYTE *pbInstalled;  // Flags per catalog entry
+    DWORD dwKLID;       // The result
+} PICKER_DATA, *PPICKER_DATA;
 
-static BOOL GetImeFile(LPTSTR szImeFile, SIZE_T cchImeFile, HKL hKL)
+static LRESULT CALLBACK
+PickerEditProc(HWND hwndEdit, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
-    szImeFile[0] = UNICODE_NULL;
+    WNDPROC fnOldProc = (WNDPROC)GetWindowLongPtr(hwndEdit, GWLP_USERDATA);
 
-    if (hKL == NULL || !IS_IME_HKL(hKL))
-        return FALSE;
+    if (uMsg == WM_KEYDOWN)
+    {
+        switch (wParam)
+        {
+            case VK_UP:
+            case VK_DOWN:
+            case VK_PRIOR:
+            case VK_NEXT:
+                SendDlgItemMessage(GetParent(hwndEdit), IDC_LAYOUTS, uMsg, wParam, lParam);
+                return 0;
+        }
+    }
 
-    return ImmGetIMEFileName(hKL, szImeFile, cchImeFile);
+    return CallWindowProc(fnOldProc, hwndEdit, uMsg, wParam, lParam);
 }
 
-static VOID
-AddTrayIcon(HWND hwnd, HKL hKL)
+static VOID FilterPickerList(HWND hDlg, PPICKER_DATA pData)
 {
-    NOTIFYICONDATA tnid = { sizeof(tnid), hwnd, 1, NIF_ICON | NIF_MESSAGE | NIF_TIP };
-    TCHAR szImeFile[80];
-    INT iEntry;
-
-    iEntry = FindLayoutEntry(hKL);
-    if (iEntry == -1)
-        return;
-
-    GetImeFile(szImeFile, _countof(szImeFile), hKL);
+    HWND hwndList = GetDlgItem(hDlg, IDC_LAYOUTS);
+    TCHAR szQuery[MAX_PATH];
+    INT iRank, iItem, iPass;
+    UINT i;
 
-    tnid.uCallbackMessage = WM_NOTIFYICONMSG;
-    tnid.hIcon = CreateTrayIcon(hKL, szImeFile);
-    StringCchCopy(tnid.szTip, _countof(tnid.szTip), g_pLayouts[iEntry].pszText);
+    GetDlgItemText(hDlg, IDC_FILTER, szQuery, _countof(szQuery));
+    CharLower(szQuery);
 
-    Shell_NotifyIcon(NIM_ADD, &tnid);
+    SendMessage(hwndList, WM_SETREDRAW, FALSE, 0);
+    ListBox_ResetContent(hwndList);
 
-    if (g_hTrayIcon)
-        DestroyIcon(g_hTrayIcon);
-    g_hTrayIcon = tnid.hIcon;
-}
+    /* Installed layouts first, then by rank, then in catalog order */
+    for (iPass = 0; iPass < 2 * PICKER_MAX_RANK; ++iPass)
+    {
+        for (i = 0; i < g_cLayoutKeys; ++i)
+        {
+            if (!pData->pbInstalled[i] != (iPass >= PICKER_MAX_RANK))
+                continue;
 
-static VOID
-DeleteTrayIcon(HWND hwnd)
-{
-    NOTIFYICONDATA tnid = { sizeof(tnid), hwnd, 1 };
-    Shell_NotifyIcon(NIM_DELETE, &tnid);
+            iRank = RankLayoutKey(g_ppszLayoutKeys[i], szQuery);
+            if (iRank != iPass % PICKER_MAX_RANK)
+                continue;
 
-    if (g_hTrayIcon)
-    {
-        DestroyIcon(g_hTrayIcon);
-        g_hTrayIcon = NULL;
+            iItem = ListBox_AddString(hwndList, g_pLayouts[i].pszText);
+            ListBox_SetItemData(hwndList, iItem, i);
+        }
     }
+
+    ListBox_SetCurSel(hwndList, 0);
+    SendMessage(hwndList, WM_SETREDRAW, TRUE, 0);
+    InvalidateRect(hwndList, NULL, TRUE);
 }
 
-static VOID
-UpdateTrayIcon(HWND hwnd, HKL hKL)
+static INT_PTR CALLBACK
+PickerDialogProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
-    NOTIFYICONDATA tnid = { sizeof(tnid), hwnd, 1, NIF_ICON | NIF_MESSAGE | NIF_TIP };
-    TCHAR szImeFile[80];
-    INT iEntry;
+    PPICKER_DATA pData = (PPICKER_DATA)GetWindowLongPtr(hDlg, DWLP_USER);
+    HWND hwndEdit;
+    INT iItem;
 
-    iEntry = FindLayoutEntry(hKL);
-    if (iEntry == -1)
-        return;
+    switch (uMsg)
+    {
+        case WM_INITDIALOG:
+        {
+            pData = (PPICKER_DATA)lParam;
+            SetWindowLongPtr(hDlg, DWLP_USER, (LONG_PTR)pData);
 
-    GetImeFile(szImeFile, _countof(szImeFile), hKL);
+            hwndEdit = GetDlgItem(hDlg, IDC_FILTER);
+            SetWindowLongPtr(hwndEdit, GWLP_USERDATA,
+                             SetWindowLongPtr(hwndEdit, GWLP_WNDPROC, (LONG_PTR)PickerEditProc));
 
-    tnid.uCallbackMessage = WM_NOTIFYICONMSG;
-    tnid.hIcon = CreateTrayIcon(hKL, szImeFile);
-    StringCchCopy(tnid.szTip, _countof(tnid.szTip), g_pLayouts[iEntry].pszText);
+            FilterPickerList(hDlg, pData);
+            SetFocus(hwndEdit);
+            return FALSE;
+        }
 
-    Shell_NotifyIcon(NIM_MODIFY, &tnid);
+        case WM_COMMAND:
+        {
+            switch (LOWORD(wParam))
+            {
+                case IDC_FILTER:
+                    if (HIWORD(wParam) == EN_CHANGE)
+                        FilterPickerList(hDlg, pData);
+                    break;
+
+                case IDC_LAYOUTS:
+                    if (HIWORD(wParam) != LBN_DBLCLK)
+                        break;
+                    /* FALL THROUGH */
+                case IDOK:
+                    iItem = (INT)SendDlgItemMessage(hDlg, IDC_LAYOUTS, LB_GETCURSEL, 0, 0);
+                    if (iItem == LB_ERR)
+                        break;
+                    iItem = (INT)SendDlgItemMessage(hDlg, IDC_LAYOUTS, LB_GETITEMDATA, iItem, 0);
+                    pData->dwKLID = g_pLayouts[iItem].dwKLID;
+                    EndDialog(hDlg, IDOK);
+                    break;
+
+                case IDCANCEL:
+                    EndDialog(hDlg, IDCANCEL);
+                    break;
+            }
+            break;
+        }
+    }
 
-    if (g_hTrayIcon)
-        DestroyIcon(g_hTrayIcon);
-    g_hTrayIcon = tnid.hIcon;
+    return FALSE;
 }
 
-static void
-RememberWindowHKL(HWND hwnd, HWND hwndTarget, HKL hKL)
+static HKL ShowLayoutPicker(HWND hwnd)
 {
-    TCHAR szHWND[32];
+    PICKER_DATA Data = { NULL, 0 };
+    HKL hKL, ahKLs[256];
+    UINT iKL, cKLs;
+    INT iEntry;
+    TCHAR szKLID[CCH_LAYOUT_ID + 1];
 
-    StringCchPrintf(szHWND, _countof(szHWND), TEXT("%p"), hwndTarget);
+    if (!EnsureFullCatalog() || g_cLayoutKeys == 0)
+        return NULL;
 
-    SetProp(hwnd, szHWND, hKL);
-}
+    Data.pbInstalled = LocalAlloc(LPTR, g_cLayoutKeys);
+    if (Data.pbInstalled == NULL)
+        return NULL;
 
-static HKL
-RecallWindowHKL(HWND hwnd, HWND hwndTarget)
-{
-    TCHAR szHWND[32];
-    DWORD dwThreadId;
-    HKL hKL;
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    for (iKL = 0; iKL < cKLs; ++iKL)
+    {
+        iEntry = FindLayoutEntry(ahKLs[iKL]);
+        if (iEntry != -1 && (UINT)iEntry < g_cLayoutKeys)
+            Data.pbInstalled[iEntry] = TRUE;
+    }
 
-    StringCchPrintf(szHWND, _countof(szHWND), TEXT("%p"), hwndTarget);
+    if (DialogBoxParam(g_hInstance, MAKEINTRESOURCE(IDD_SELECTLAYOUT), hwnd, PickerDialogProc,
+                       (LPARAM)&Data) != IDOK)
+    {
+        LocalFree(Data.pbInstalled);
+        return NULL;
+    }
+    LocalFree(Data.pbInstalled);
 
-    hKL = (HKL)GetProp(hwnd, szHWND);
+    hKL = GetInstalledLayout(Data.dwKLID);
     if (hKL == NULL)
     {
-        dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
-        hKL = GetKeyboardLayout(dwThreadId);
-        if (hKL == NULL)
-            hKL = GetKeyboardLayout(0);
+        StringCchPrintf(szKLID, _countof(szKLID), TEXT("%08lX"), Data.dwKLID);
+        hKL = LoadKeyboardLayout(szKLID, 0);
     }
 
     return hKL;
 }
 
-static void
-ForgetWindowHKL(HWND hwnd, HWND hwndTarget)
+static void OnCommand(HWND hwnd, int id, HWND hwndCtl, UINT codeNotify)
 {
-    TCHAR szHWND[32];
+    switch (id)
+    {
+        case ID_EXIT:
+        {
+            PostMessage(hwnd, WM_CLOSE, 0, 0);
+            break;
+        }
 
-    StringCchPrintf(szHWND, _countof(szHWND), TEXT("%p"), hwndTarget);
-    RemoveProp(hwnd, szHWND);
+        case ID_PREFERENCES:
+        {
+            INT_PTR ret = (INT_PTR)ShellExecute(hwnd, NULL,
+                                                TEXT("control.exe"), TEXT("input.dll"),
+                                                NULL, SW_SHOWNORMAL);
+            if (ret <= 32)
+                MessageBox(hwnd, _T("Can't start input.dll"), NULL, MB_ICONERROR);
+            break;
+        }
+
+        case ID_NEXTLAYOUT:
+        {
+            HKL hKL = GetNextLayout();
+            PostChooseLayout(hwnd, hKL);
+            break;
+        }
+
+        case ID_SELECTLAYOUT:
+        {
+            HKL hKL = ShowLayoutPicker(hwnd);
+            if (hKL)
+            {
+                PostChooseLayout(hwnd, hKL);
+                g_hKL = hKL;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
 }
 
-static BOOL OnCreate(HWND hwnd, LPCREATESTRUCT lpCreateStruct)
+// Returns TRUE if g_hEventKL has been updated.
+static BOOL OnLanguage(HWND hwnd, HWND hwndTarget, HKL hKL)
 {
-    if (!LoadKeyboardLayouts())
+    TRACE("WM_LANGUAGE: %p, %p\n", hwndTarget, hKL);
+    if (hKL == NULL || hwndTarget == NULL)
         return FALSE;
-
-    g_hDLL = LoadLibrary(TEXT("kbsdll.dll"));
-    if (!g_hDLL)
-        return TRUE;
-
-    g_fnKbsHook = (FN_KBS_HOOK)GetProcAddress(g_hDLL, "KbsHook");
-    g_fnKbsUnhook = (FN_KBS_UNHOOK)GetProcAddress(g_hDLL, "KbsUnhook");
-    if (!g_fnKbsHook || !g_fnKbsUnhook)
-    {
-        g_fnKbsHook = NULL;
-        g_fnKbsUnhook = NULL;
-        FreeLibrary(g_hDLL);
-        g_hDLL = NULL;
+    DumpWndInfo(hwndTarget);
+    if (IsWndIgnored(hwndTarget))
         return FALSE;
+    if (IsConsoleWnd(hwndTarget) && hKL)
+        RememberWindowHKL(hwnd, hwndTarget, hKL);
+    CacheThreadLayout(hwndTarget, hKL);
+    RememberAppLayout(hwndTarget, hKL);
+    g_hEventKL = hKL;
+
+    /* Switched in the foreground window: the desktop follows */
+    if (g_bGlobalMode && hKL != g_hGlobalKL &&
+        RealGetTopLevelOwner(hwndTarget) == RealGetTopLevelOwner(GetForegroundWindow()))
+    {
+        PropagateLayout(hwnd, hKL, GetWindowThreadProcessId(hwndTarget, NULL));
     }
-
-    g_hKL = GetKeyboardLayout(0);
-    AddTrayIcon(hwnd, g_hKL);
-    g_hwndTrayWnd = GetTrayWnd();
-    g_uTaskbarRestart = RegisterWindowMessage(TEXT("TaskbarCreated"));
-
-    g_dwCodePageBitField = GetCodePageBitField(hwnd);
-
-    g_fnKbsHook(hwnd);
-    SetTimer(hwnd, TIMER_ID, TIMER_INTERVAL, NULL);
     return TRUE;
 }
 
-static void OnTimer(HWND hwnd, UINT id)
+// Returns TRUE if g_hEventKL has been updated.
+static BOOL OnWindowActivated(HWND hwnd, HWND hwndTarget)
 {
-    if (id != TIMER_ID)
-        return;
+    HKL hKL = NULL;
+    TRACE("WM_WINDOWACTIVATED: %p\n", hwndTarget);
 
-    HWND hwndTarget = GetForegroundWindow();
     if (IsWndIgnored(hwndTarget))
-        return;
+        return FALSE;
 
-    SetLastActive(hwndTarget, __LINE__);
+    DumpWndInfo(hwndTarget);
 
-    DWORD dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
-    HKL hKL = GetKeyboardLayout(dwThreadId);
-    if (hKL == NULL)
+    if (IsConsoleWnd(hwndTarget))
     {
         hKL = RecallWindowHKL(hwnd, hwndTarget);
     }
+    else
+    {
+        hKL = GetThreadLayout(hwndTarget);
+    }
 
-    TRACE("hKL++: %p\n", hKL);
-    UpdateTrayIcon(hwnd, hKL);
-    g_hKL = hKL;
+    hKL = ApplyLayoutPolicy(hwnd, hwndTarget, hKL);
+
+    g_hEventKL = hKL;
+    return TRUE;
 }
 
-static BOOL CALLBACK
-RemovePropProc(HWND hwnd, LPCTSTR lpszString, HANDLE hData)
+static void OnWindowCreated(HWND hwnd, HWND hwndTarget)
 {
-    RemoveProp(hwnd, lpszString);
-    return TRUE;
+    TRACE("WM_WINDOWCREATED: %p\n", hwndTarget);
+    DumpWndInfo(hwndTarget);
 }
 
-static void OnDestroy(HWND hwnd)
+static void OnWindowDestroyed(HWND hwnd, HWND hwndTarget)
 {
-    KillTimer(hwnd, TIMER_ID);
+    TRACE("WM_WINDOWDESTROYED: %p\n", hwndTarget);
+    DumpWndInfo(hwndTarget);
+    if (IsConsoleWnd(hwndTarget))
+        ForgetWindowHKL(hwnd, hwndTarget);
+    ForgetThreadLayout(hwndTarget);
+}
 
-    if (g_hMenu)
-    {
-        DestroyMenu(g_hMenu);
-        g_hMenu = NULL;
-    }
+static void OnWindowSetFocus(HWND hwnd, HWND hwndGaining, HWND hwndLosing)
+{
+    TRACE("WM_WINDOWSETFOCUS: %p, %p\n", hwndGaining, hwndLosing);
+    DumpWndInfo(hwndGaining);
+}
 
-    DeleteTrayIcon(hwnd);
+/*
+ * Coalescing of the hook events.
+ *
+ * kbsdll posts a message for every window event on the desktop. Instead of
+ * handling each of them in order, WindowProc records them per window and
+ * handles the result once per drain: only the latest language and focus of a
+ * window and the latest activation are kept, and a window that is created and
+ * destroyed within a drain is never looked at. The window of the latest
+ * language event is handled last, so that its layout is the one shown. The number of windows in a drain
+ * is bounded; the language, focus and creation events that don't fit are
+ * dropped and counted. A destruction that doesn't fit is handled at once, or
+ * the state kept for the window would leak.
+ */
+#define MAX_PENDING_WINDOWS 64
 
-    if (g_fnKbsUnhook)
+#define PENDING_LANGUAGE    0x1
+#define PENDING_CREATED     0x2
+#define PENDING_DESTROYED   0x4
+#define PENDING_SETFOCUS    0x8
+
+typedef struct tagPENDING_WINDOW
+{
+    HWND hwndTarget;
+    DWORD dwFlags;      // PENDING_*; zero if collapsed
+    HKL hKL;            // of the latest PENDING_LANGUAGE
+    HWND hwndLosing;    // of the latest PENDING_SETFOCUS
+} PENDING_WINDOW, *PPENDING_WINDOW;
+
+PENDING_WINDOW g_PendingWindows[MAX_PENDING_WINDOWS];
+UINT g_cPendingWindows = 0;
+HWND g_hwndPendingActivated = NULL;
+HWND g_hwndPendingLanguage = NULL; // Of the latest WM_LANGUAGE
+BOOL g_bDrainPosted = FALSE;
+
+static PPENDING_WINDOW FindPendingWindow(HWND hwndTarget, BOOL bAdd)
+{
+    PPENDING_WINDOW pPending;
+    UINT i;
+
+    for (i = 0; i < g_cPendingWindows; ++i)
     {
-        g_fnKbsUnhook();
+        if (g_PendingWindows[i].hwndTarget == hwndTarget)
+            return &g_PendingWindows[i];
     }
 
-    if (g_hDLL)
+    if (!bAdd || g_cPendingWindows >= MAX_PENDING_WINDOWS)
+        return NULL;
+
+    pPending = &g_PendingWindows[g_cPendingWindows++];
+    ZeroMemory(pPending, sizeof(*pPending));
+    pPending->hwndTarget = hwndTarget;
+
+    if (g_Counters.cMaxQueueDepth < g_cPendingWindows)
+        g_Counters.cMaxQueueDepth = g_cPendingWindows;
+
+    return pPending;
+}
+
+static void QueueShellEvent(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    HWND hwndTarget = (HWND)wParam;
+    PPENDING_WINDOW pPending;
+    DWORD dwDelay = GetTickCount() - (DWORD)GetMessageTime();
+
+    ++g_Counters.cEventsReceived;
+    g_Counters.dwTotalEventDelay += dwDelay;
+    if (g_Counters.dwMaxEventDelay < dwDelay)
+        g_Counters.dwMaxEventDelay = dwDelay;
+
+    if (uMsg == WM_WINDOWACTIVATED)
     {
-        FreeLibrary(g_hDLL);
-        g_hDLL = NULL;
+        if (g_hwndPendingActivated)
+            ++g_Counters.cEventsCoalesced;
+        g_hwndPendingActivated = hwndTarget;
     }
+    else
+    {
+        pPending = FindPendingWindow(hwndTarget, TRUE);
+        if (pPending == NULL && uMsg == WM_WINDOWDESTROYED)
+        {
+            /* Nothing of it is pending, so it can't be handled out of order */
+            if (g_hwndPendingActivated == hwndTarget)
+                g_hwndPendingActivated = NULL;
+            OnWindowDestroyed(hwnd, hwndTarget);
+            return;
+        }
+        if (pPending == NULL)
+        {
+            ++g_Counters.cEventsDropped;
+            return;
+        }
 
-    g_fnKbsHook = NULL;
-    g_fnKbsUnhook = NULL;
+        switch (uMsg)
+        {
+            case WM_LANGUAGE:
+                if (pPending->dwFlags & PENDING_LANGUAGE)
+                    ++g_Counters.cEventsCoalesced;
+                pPending->dwFlags |= PENDING_LANGUAGE;
+                pPending->hKL = (HKL)lParam;
+                g_hwndPendingLanguage = hwndTarget;
+                break;
 
-    EnumProps(hwnd, RemovePropProc);
+            case WM_WINDOWCREATED:
+                pPending->dwFlags |= PENDING_CREATED;
+                break;
 
-    FreeKeyboardLayouts();
+            case WM_WINDOWDESTROYED:
+                if (pPending->dwFlags & PENDING_CREATED)
+                {
+                    /* Created and destroyed within a drain: forget it */
+                    g_Counters.cEventsCoalesced += 2;
+                    pPending->dwFlags = 0;
+                    if (g_hwndPendingActivated == hwndTarget)
+                        g_hwndPendingActivated = NULL;
+                    break;
+                }
+                pPending->dwFlags |= PENDING_DESTROYED;
+                break;
 
-    PostQuitMessage(0);
+            case WM_WINDOWSETFOCUS:
+                if (pPending->dwFlags & PENDING_SETFOCUS)
+                    ++g_Counters.cEventsCoalesced;
+                pPending->dwFlags |= PENDING_SETFOCUS;
+                pPending->hwndLosing = (HWND)lParam;
+                break;
+        }
+    }
+
+    if (!g_bDrainPosted)
+        g_bDrainPosted = PostMessage(hwnd, WM_DRAINEVENTS, 0, 0);
 }
 
-static void ChooseLayout(HWND hwnd, HKL hKL)
+// Lets the UI thread show hKL. Never blocks; only the latest layout is shown.
+static void HandOffLayout(HWND hwnd, HKL hKL)
 {
-    HWND hwndTarget = g_hwndLastActive;
-    if (hwndTarget == NULL)
+    if (hwnd == g_hwndMain)
+    {
+        g_hKL = hKL;
+        UpdateTrayIcon(hwnd, hKL);
         return;
+    }
 
-    HWND hwndTopLevel = GetTopLevelOwner(hwndTarget);
-    DWORD dwTID1 = GetWindowThreadProcessId(hwndTopLevel, NULL);
-    DWORD dwTID2 = GetWindowThreadProcessId(hwndTarget, NULL);
-    if (dwTID1 != dwTID2)
+    InterlockedExchangePointer((PVOID volatile *)&g_pHandoffKL, hKL);
+    if (!InterlockedExchange(&g_lHandoffPosted, TRUE) &&
+        !PostMessage(g_hwndMain, WM_STATECHANGED, 0, 0))
     {
-        hwndTopLevel = hwndTarget;
+        InterlockedExchange(&g_lHandoffPosted, FALSE);
     }
+}
 
-    HWND hwndLastActive = GetLastActivePopup(hwndTopLevel);
-    SetForegroundWindow(hwndLastActive);
+static void OnStateChanged(HWND hwnd)
+{
+    HKL hKL;
 
-    BOOL bSupported = IsHKLCharSetSupported(hKL);
-    PostMessage(hwndLastActive, WM_INPUTLANGCHANGEREQUEST, bSupported, (LPARAM)hKL);
+    /* Cleared first, so that a newer layout is posted again */
+    InterlockedExchange(&g_lHandoffPosted, FALSE);
+    hKL = (HKL)InterlockedCompareExchangePointer((PVOID volatile *)&g_pHandoffKL, NULL, NULL);
 
-    TRACE("hKL--: %p\n", hKL);
+    g_hKL = hKL;
+    UpdateTrayIcon(hwnd, hKL);
 }
 
-static void OnNotifyIcon(HWND hwnd, LPARAM lParam)
+#define SLOW_DRAIN_TIME 100 // A drain that long is a stall of the events
+
+// Returns TRUE if g_hEventKL has been updated.
+static BOOL HandlePendingWindow(HWND hwnd, const PENDING_WINDOW *pPending)
 {
-    POINT pt;
+    BOOL bUpdateTray = FALSE;
+
+    if (pPending->dwFlags & PENDING_CREATED)
+        OnWindowCreated(hwnd, pPending->hwndTarget);
+    if (pPending->dwFlags & PENDING_LANGUAGE)
+        bUpdateTray = OnLanguage(hwnd, pPending->hwndTarget, pPending->hKL);
+    if (pPending->dwFlags & PENDING_SETFOCUS)
+        OnWindowSetFocus(hwnd, pPending->hwndTarget, pPending->hwndLosing);
+    if (pPending->dwFlags & PENDING_DESTROYED)
+        OnWindowDestroyed(hwnd, pPending->hwndTarget);
+
+    return bUpdateTray;
+}
 
-    switch (lParam)
+static void DrainShellEvents(HWND hwnd)
+{
+    PENDING_WINDOW Pending[MAX_PENDING_WINDOWS];
+    UINT i, iLatest = MAX_PENDING_WINDOWS, cPending = g_cPendingWindows;
+    HWND hwndActivated = g_hwndPendingActivated;
+    HWND hwndLanguage = g_hwndPendingLanguage;
+    BOOL bUpdateTray = FALSE;
+    DWORD dwStart = GetTickCount(), dwTime;
+    LONGLONG qwSpan = BeginSpan();
+
+    /* The handlers may queue more events */
+    CopyMemory(Pending, g_PendingWindows, cPending * sizeof(PENDING_WINDOW));
+    g_cPendingWindows = 0;
+    g_hwndPendingActivated = NULL;
+    g_hwndPendingLanguage = NULL;
+    g_bDrainPosted = FALSE;
+    ++g_Counters.cDrains;
+
+    /* The windows are in first-seen order; the latest language goes last */
+    for (i = 0; i < cPending; ++i)
     {
-        case WM_RBUTTONUP:
-        case WM_LBUTTONUP:
-        {
-            KillTimer(hwnd, TIMER_ID);
+        if (Pending[i].hwndTarget == hwndLanguage && (Pending[i].dwFlags & PENDING_LANGUAGE))
+            iLatest = i;
+        else
+            bUpdateTray |= HandlePendingWindow(hwnd, &Pending[i]);
+    }
+    if (iLatest < cPending)
+        bUpdateTray |= HandlePendingWindow(hwnd, &Pending[iLatest]);
 
-            GetCursorPos(&pt);
-            SetForegroundWindow(hwnd);
+    if (hwndActivated)
+        bUpdateTray |= OnWindowActivated(hwnd, hwndActivated);
 
-            if (lParam == WM_LBUTTONUP)
-            {
-                /* Rebuild the left popup menu on every click to take care of keyboard layout changes */
-                HKL hKL = ShowKeyboardMenu(hwnd, g_hKL, pt);
-                if (hKL)
-                {
-                    ChooseLayout(hwnd, hKL);
-                    g_hKL = hKL;
-                }
-            }
-            else
-            {
-                if (!g_hRightPopupMenu)
-                {
-                    g_hMenu = LoadMenu(g_hInstance, MAKEINTRESOURCE(IDR_POPUP));
-                    g_hRightPopupMenu = GetSubMenu(g_hMenu, 0);
-                }
-                TrackPopupMenu(g_hRightPopupMenu, 0, pt.x, pt.y, 0, hwnd, NULL);
-            }
+    if (bUpdateTray)
+        HandOffLayout(hwnd, g_hEventKL);
 
-            PostMessage(hwnd, WM_NULL, 0, 0);
-            PostMessage(g_hwndTrayWnd, WM_NULL, 0, 0);
+    EndSpan("DrainShellEvents", cPending, qwSpan);
 
-            SetTimer(hwnd, TIMER_ID, TIMER_INTERVAL, NULL);
-            break;
-        }
-    }
+    dwTime = GetTickCount() - dwStart;
+    if (dwTime >= SLOW_DRAIN_TIME)
+        ++g_Counters.cSlowDrains;
+    if (g_Counters.dwMaxDrainTime < dwTime)
+        g_Counters.dwMaxDrainTime = dwTime;
 }
 
-static VOID AttachWindowInput(HWND hwndAttach)
+// kbsdll has run the activation of ChooseLayout on the target's thread
+static void OnLayoutActivated(HWND hwnd, DWORD dwSeq, BOOL bSucceeded)
 {
-    DWORD dwTID1 = GetWindowThreadProcessId(g_hwndTrayWnd, NULL);
-    DWORD dwTID2 = GetWindowThreadProcessId(hwndAttach, NULL);
-    if (!AttachThreadInput(dwTID2, dwTID1, TRUE))
-        MessageBeep(0);
-}
+    TRACE("WM_LAYOUTACTIVATED: #%lu, %d\n", dwSeq, bSucceeded);
+    if (dwSeq == 0 || dwSeq != g_dwActivationSeq)
+        return; // Cancelled or superseded
 
-static HKL GetNextLayout(void)
-{
-    HKL ahKLs[256];
-    UINT iKL, cKLs;
+    KillTimer(hwnd, ACTIVATE_TIMER_ID);
+    g_fnKbsCancelActivation(dwSeq); // Removes its hook
+    g_dwActivationSeq = 0;
 
-    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
-    for (iKL = 0; iKL < cKLs; ++iKL)
+    if (!bSucceeded)
     {
-        if (g_hKL == ahKLs[iKL])
-        {
-            return ahKLs[(iKL + 1) % cKLs];
-        }
+        RequestLayout(g_hwndActivation, g_hKLActivation);
+        return;
     }
 
-    return NULL;
+    ++g_Counters.cActivationsDirect;
+
+    // Not every activation raises HSHELL_LANGUAGE; report it as one
+    QueueShellEvent(hwnd, WM_LANGUAGE, (WPARAM)g_hwndActivation, (LPARAM)g_hKLActivation);
 }
 
-static void OnCommand(HWND hwnd, int id, HWND hwndCtl, UINT codeNotify)
+/*
+ * The event thread.
+ *
+ * While a menu of the tray is open, the UI thread sits in a modal loop, and the
+ * hook events would wait for it and be handled late in a burst. They are
+ * handled by a thread of their own instead, on a message-only window that
+ * kbsdll posts to. It tracks the layouts of the windows and runs ChooseLayout;
+ * the layout to show is handed to the UI thread by HandOffLayout. If the thread
+ * cannot be started, the UI thread handles the events as before.
+ */
+#define KBSWITCH_EVENT_CLASS TEXT("kbswitch.Events")
+
+static LRESULT CALLBACK
+EventWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
-    switch (id)
+    switch (uMsg)
     {
-        case ID_EXIT:
+        case WM_LANGUAGE: // HSHELL_LANGUAGE
+        case WM_WINDOWACTIVATED: // HSHELL_WINDOWACTIVATED
+        case WM_WINDOWCREATED: // HSHELL_WINDOWCREATED
+        case WM_WINDOWDESTROYED: // HSHELL_WINDOWDESTROYED
+        case WM_WINDOWSETFOCUS: // HCBT_SETFOCUS
         {
-            PostMessage(hwnd, WM_CLOSE, 0, 0);
+            QueueShellEvent(hwnd, uMsg, wParam, lParam);
             break;
         }
-
-        case ID_PREFERENCES:
+        case WM_DRAINEVENTS:
         {
-            INT_PTR ret = (INT_PTR)ShellExecute(hwnd, NULL,
-                                                TEXT("control.exe"), TEXT("input.dll"),
-                                                NULL, SW_SHOWNORMAL);
-            if (ret <= 32)
-                MessageBox(hwnd, _T("Can't start input.dll"), NULL, MB_ICONERROR);
+            DrainShellEvents(hwnd);
             break;
         }
-
-        case ID_NEXTLAYOUT:
+        case WM_LAYOUTACTIVATED:
         {
-            HKL hKL = GetNextLayout();
-            ChooseLayout(hwnd, hKL);
+            OnLayoutActivated(hwnd, (DWORD)wParam, (BOOL)lParam);
             break;
         }
-
-        default:
+        case WM_CHOOSELAYOUT:
+        {
+            OnChooseLayout(hwnd, (HKL)lParam);
+            break;
+        }
+        case WM_RELOADPOLICY:
+        {
+            LoadLayoutPolicy();
+            break;
+        }
+        case WM_TIMER:
+        {
+            if (wParam == ACTIVATE_TIMER_ID)
+                AbandonActivation(hwnd, TRUE);
+            else if (wParam == PROPAGATE_TIMER_ID)
+                OnPropagateTimer(hwnd);
+            break;
+        }
+        case WM_DESTROY:
+        {
+            AbandonActivation(hwnd, FALSE);
+            KillTimer(hwnd, PROPAGATE_TIMER_ID);
+            EnumProps(hwnd, RemovePropProc);
+            PostQuitMessage(0);
             break;
+        }
+        default:
+            return DefWindowProc(hwnd, uMsg, wParam, lParam);
     }
+    return 0;
 }
 
-LRESULT CALLBACK
-WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+static DWORD WINAPI EventThreadProc(LPVOID lpParameter)
+{
+    HANDLE hReady = (HANDLE)lpParameter;
+    MSG msg;
+
+    g_hwndEvents = CreateWindow(KBSWITCH_EVENT_CLASS, NULL, 0, 0, 0, 0, 0, HWND_MESSAGE,
+                                NULL, g_hInstance, NULL);
+    SetEvent(hReady);
+    if (g_hwndEvents == NULL)
+        return 1;
+
+    while (GetMessage(&msg, NULL, 0, 0))
+    {
+        DispatchMessage(&msg);
+    }
+
+    return 0;
+}
+
+static VOID StartEventThread(VOID)
+{
+    WNDCLASS WndClass;
+    HANDLE hReady;
+
+    ZeroMemory(&WndClass, sizeof(WndClass));
+    WndClass.lpfnWndProc   = EventWindowProc;
+    WndClass.hInstance     = g_hInstance;
+    WndClass.lpszClassName = KBSWITCH_EVENT_CLASS;
+    if (!RegisterClass(&WndClass))
+        return;
+
+    hReady = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (hReady == NULL)
+        return;
+
+    g_hEventThread = CreateThread(NULL, 0, EventThreadProc, hReady, 0, NULL);
+    if (g_hEventThread)
+    {
+        WaitForSingleObject(hReady, INFINITE);
+        if (g_hwndEvents == NULL)
+        {
+            WaitForSingleObject(g_hEventThread, INFINITE);
+            CloseHandle(g_hEventThread);
+            g_hEventThread = NULL;
+        }
+    }
+
+    CloseHandle(hReady);
+}
+
+static LRESULT
+HandleMainMessage(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
     switch (uMsg)
     {
@@ -885,70 +5253,49 @@ WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             OnNotifyIcon(hwnd, lParam);
             break;
         }
-        case WM_LANGUAGE: // HSHELL_LANGUAGE
+        case WM_WTSSESSION_CHANGE:
         {
-            HWND hwndTarget = (HWND)wParam;
-            HKL hKL = (HKL)lParam;
-            TRACE("WM_LANGUAGE: %p, %p\n", wParam, lParam);
-            if (hKL == NULL || hwndTarget == NULL)
-                break;
-            DumpWndInfo(hwndTarget);
-            if (IsWndIgnored(hwndTarget))
-                break;
-            if (IsConsoleWnd(hwndTarget) && hKL)
-                RememberWindowHKL(hwnd, hwndTarget, hKL);
-            g_hKL = hKL;
-            UpdateTrayIcon(hwnd, g_hKL);
+            OnSessionChange(hwnd, wParam);
             break;
         }
+        case WM_LANGUAGE: // HSHELL_LANGUAGE
         case WM_WINDOWACTIVATED: // HSHELL_WINDOWACTIVATED
+        case WM_WINDOWCREATED: // HSHELL_WINDOWCREATED
+        case WM_WINDOWDESTROYED: // HSHELL_WINDOWDESTROYED
+        case WM_WINDOWSETFOCUS: // HCBT_SETFOCUS
         {
-            HWND hwndTarget = (HWND)wParam;
-            DWORD dwThreadId = 0;
-            HKL hKL = NULL;
-            TRACE("WM_WINDOWACTIVATED: %p, %p\n", wParam, lParam);
-
-            if (IsWndIgnored(hwndTarget))
-                break;
-
-            DumpWndInfo(hwndTarget);
-
-            if (IsConsoleWnd(hwndTarget))
-            {
-                hKL = RecallWindowHKL(hwnd, hwndTarget);
-            }
-            else
-            {
-                dwThreadId = GetWindowThreadProcessId(hwndTarget, NULL);
-                hKL = GetKeyboardLayout(dwThreadId);
-            }
-
-            g_hKL = hKL;
-            UpdateTrayIcon(hwnd, g_hKL);
+            QueueShellEvent(hwnd, uMsg, wParam, lParam);
             break;
         }
-        case WM_WINDOWCREATED: // HSHELL_WINDOWCREATED
+        case WM_LAYOUTACTIVATED:
         {
-            HWND hwndTarget = (HWND)wParam;
-            TRACE("WM_WINDOWCREATED: %p, %p\n", wParam, lParam);
-            DumpWndInfo(hwndTarget);
+            OnLayoutActivated(hwnd, (DWORD)wParam, (BOOL)lParam);
             break;
         }
-        case WM_WINDOWDESTROYED: // HSHELL_WINDOWCREATED
+        case WM_DRAINEVENTS:
         {
-            HWND hwndTarget = (HWND)wParam;
-            TRACE("WM_WINDOWDESTROYED: %p, %p\n", wParam, lParam);
-            DumpWndInfo(hwndTarget);
-            if (IsConsoleWnd(hwndTarget))
-                ForgetWindowHKL(hwnd, hwndTarget);
+            DrainShellEvents(hwnd);
             break;
         }
-        case WM_WINDOWSETFOCUS: // HCBT_SETFOCUS
+        case WM_STARTUPSTAGE:
+        {
+            StartEventThread();
+            InstallHooks(hwnd);
+            break;
+        }
+        case WM_STATECHANGED:
+        {
+            OnStateChanged(hwnd);
+            break;
+        }
+        case WM_CATALOGLOADED:
+        {
+            OnCatalogLoaded(hwnd, (BOOL)wParam);
+            break;
+        }
+        case WM_CONTROLREQUEST:
         {
-            HWND hwndGaining = (HWND)wParam;
-            HWND hwndLosing = (HWND)lParam;
-            TRACE("WM_WINDOWSETFOCUS: %p, %p\n", wParam, lParam);
-            DumpWndInfo(hwndGaining);
+            OnControlRequest(hwnd, (const KBSCTL_REQUEST *)wParam, (PCONTROL_REPLY)lParam);
             break;
         }
         default:
@@ -965,14 +5312,206 @@ WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     return 0;
 }
 
+LRESULT CALLBACK
+WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    LONGLONG qwSpan = BeginSpan();
+    LRESULT lResult = HandleMainMessage(hwnd, uMsg, wParam, lParam);
+    EndSpan("WindowProc", uMsg, qwSpan);
+    return lResult;
+}
+
+/*
+ * The training run of the profile-guided builds ("/train [rounds]").
+ *
+ * Runs the paths that matter at run time without the tray, the hooks or the
+ * single instance: the catalog and the policy are loaded, and the shell events
+ * of a few windows of this thread are queued and drained on an event window.
+ * That exercises the coalescing, the layout cache, the policy, the switching by
+ * WM_INPUTLANGCHANGEREQUEST and the drawing of the badge. The windows are
+ * visible to the handlers but off the screen, and only this thread's layout is
+ * switched. The time per round is traced and, with "/profile <file>", appended
+ * to the file, so that the plain, LTO and PGO builds can be compared.
+ */
+#define TRAIN_WINDOWS 8
+#define TRAIN_DEFAULT_ROUNDS 2000
+
+static VOID PumpTrainingMessages(VOID)
+{
+    MSG msg;
+
+    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+    {
+        if (msg.message == WM_QUIT)
+            break;
+        DispatchMessage(&msg);
+    }
+}
+
+static INT RunTraining(VOID)
+{
+    WNDCLASS WndClass;
+    HWND hwnd, ahwndTargets[TRAIN_WINDOWS];
+    HKL ahKLs[64];
+    UINT cKLs, iRound, iWnd;
+    LARGE_INTEGER liFreq, liBegin, liEnd;
+    CHAR szLine[256];
+    double usRound;
+
+    g_cCatalogThreads = GetSettingDword(TEXT("CatalogThreads"), DEFAULT_CATALOG_THREADS);
+    LoadRuntimeSettings();
+    if (!LoadKeyboardLayouts())
+        return 1;
+    LoadLayoutPolicy();
+    InterlockedExchange((LONG volatile *)&g_bCatalogReady, TRUE);
+    BuildLayoutIndex();
+
+    cKLs = GetKeyboardLayoutList(_countof(ahKLs), ahKLs);
+    if (cKLs == 0)
+        return 1;
+
+    ZeroMemory(&WndClass, sizeof(WndClass));
+    WndClass.lpfnWndProc   = EventWindowProc;
+    WndClass.hInstance     = g_hInstance;
+    WndClass.lpszClassName = KBSWITCH_EVENT_CLASS;
+    if (!RegisterClass(&WndClass))
+        return 1;
+
+    /* The layout is handed off to this very window; see HandOffLayout */
+    hwnd = CreateWindow(KBSWITCH_EVENT_CLASS, NULL, 0, 0, 0, 0, 0, HWND_MESSAGE,
+                        NULL, g_hInstance, NULL);
+    if (hwnd == NULL)
+        return 1;
+    g_hwndMain = hwnd;
+    g_hKL = GetKeyboardLayout(0);
+
+    for (iWnd = 0; iWnd < TRAIN_WINDOWS; ++iWnd)
+    {
+        ahwndTargets[iWnd] = CreateWindowEx(WS_EX_TOOLWINDOW | WS_EX_NOACTIVATE, TEXT("STATIC"),
+                                            TEXT("kbswitch training"), WS_POPUP,
+                                            -32000, -32000, 1, 1, NULL, NULL, g_hInstance, NULL);
+        if (ahwndTargets[iWnd] == NULL)
+        {
+            while (iWnd-- > 0)
+                DestroyWindow(ahwndTargets[iWnd]);
+            DestroyWindow(hwnd);
+            return 1;
+        }
+        ShowWindow(ahwndTargets[iWnd], SW_SHOWNOACTIVATE);
+        QueueShellEvent(hwnd, WM_WINDOWCREATED, (WPARAM)ahwndTargets[iWnd], 0);
+    }
+    PumpTrainingMessages();
+
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liBegin);
+
+    for (iRound = 0; iRound < g_cTrainRounds; ++iRound)
+    {
+        /* The second half runs in the global mode */
+        g_bGlobalMode = (iRound >= g_cTrainRounds / 2);
+
+        for (iWnd = 0; iWnd < TRAIN_WINDOWS; ++iWnd)
+        {
+            QueueShellEvent(hwnd, WM_WINDOWSETFOCUS, (WPARAM)ahwndTargets[iWnd],
+                            (LPARAM)ahwndTargets[(iWnd + TRAIN_WINDOWS - 1) % TRAIN_WINDOWS]);
+            QueueShellEvent(hwnd, WM_WINDOWACTIVATED, (WPARAM)ahwndTargets[iWnd], 0);
+            if (iWnd & 1)
+            {
+                QueueShellEvent(hwnd, WM_LANGUAGE, (WPARAM)ahwndTargets[iWnd],
+                                (LPARAM)ahKLs[(iRound + iWnd) % cKLs]);
+            }
+            PumpTrainingMessages();
+        }
+
+        /* As the tray menu does */
+        SetLastActive(ahwndTargets[iRound % TRAIN_WINDOWS], __LINE__);
+        PostChooseLayout(hwnd, GetNextLayout());
+        PumpTrainingMessages();
+    }
+
+    QueryPerformanceCounter(&liEnd);
+
+    for (iWnd = 0; iWnd < TRAIN_WINDOWS; ++iWnd)
+        QueueShellEvent(hwnd, WM_WINDOWDESTROYED, (WPARAM)ahwndTargets[iWnd], 0);
+    PumpTrainingMessages();
+
+    for (iWnd = 0; iWnd < TRAIN_WINDOWS; ++iWnd)
+        DestroyWindow(ahwndTargets[iWnd]);
+    DestroyWindow(hwnd);
+    PumpTrainingMessages();
+
+    usRound = (liEnd.QuadPart - liBegin.QuadPart) * 1000000.0 / liFreq.QuadPart / g_cTrainRounds;
+    StringCchPrintfA(szLine, _countof(szLine),
+                     "train: %u rounds of %u windows, %.2fus per round; %lu events, "
+                     "%lu drains, cache %lu hits %lu misses\r\n",
+                     g_cTrainRounds, TRAIN_WINDOWS, usRound, g_Counters.cEventsReceived,
+                     g_Counters.cDrains, g_Counters.cLayoutCacheHits,
+                     g_Counters.cLayoutCacheMisses);
+    TRACE("%s", szLine);
+    AppendProfileLine(szLine);
+
+    if (g_hTrayIcon)
+    {
+        DestroyTrackedIcon(HANDLE_OWNER_TRAY, g_hTrayIcon);
+        g_hTrayIcon = NULL;
+    }
+    ReportHandles();
+
+    FreeLayoutPolicy();
+    FreeLayoutIndex();
+    FreeKeyboardLayouts();
+    CloseSharedCatalog();
+    return 0;
+}
+
+static VOID ParseCommandLine(VOID)
+{
+    INT iArg;
+
+    for (iArg = 1; iArg < __argc; ++iArg)
+    {
+        if (_tcsicmp(__targv[iArg], TEXT("/reg")) == 0 && iArg + 1 < __argc)
+        {
+            ++iArg;
+            if (!GetFullPathName(__targv[iArg], _countof(g_szLayoutsRegFile), g_szLayoutsRegFile, NULL))
+                g_szLayoutsRegFile[0] = 0;
+        }
+        else if (_tcsicmp(__targv[iArg], TEXT("/profile")) == 0 && iArg + 1 < __argc)
+        {
+            ++iArg;
+            if (!GetFullPathName(__targv[iArg], _countof(g_szStartupProfile), g_szStartupProfile, NULL))
+                g_szStartupProfile[0] = 0;
+        }
+        else if (_tcsicmp(__targv[iArg], TEXT("/catalog")) == 0)
+        {
+            g_bPublishCatalog = TRUE;
+        }
+        else if (_tcsicmp(__targv[iArg], TEXT("/trace")) == 0)
+        {
+            StartSpanSession();
+        }
+        else if (_tcsicmp(__targv[iArg], TEXT("/train")) == 0)
+        {
+            g_cTrainRounds = TRAIN_DEFAULT_ROUNDS;
+            if (iArg + 1 < __argc && _istdigit(__targv[iArg + 1][0]))
+            {
+                ++iArg;
+                g_cTrainRounds = max(_ttoi(__targv[iArg]), 1);
+            }
+        }
+    }
+}
+
 int main(void)
 {
     WNDCLASS WndClass;
-    MSG msg;
+    INT ret;
     HANDLE hMutex;
     HWND hwnd;
     HINSTANCE hInstance = GetModuleHandle(NULL);
 
+    QueryPerformanceCounter(&g_liStartup);
+
     switch (GetUserDefaultUILanguage())
     {
         case MAKELANGID(LANG_HEBREW, SUBLANG_DEFAULT):
@@ -982,6 +5521,29 @@ int main(void)
             break;
     }
 
+    g_hInstance = hInstance;
+    ParseCommandLine();
+
+    /* The training may run beside the running instance */
+    if (g_cTrainRounds)
+    {
+        InitializeCriticalSection(&g_csCatalog);
+        ret = RunTraining();
+        DeleteCriticalSection(&g_csCatalog);
+        return ret;
+    }
+
+    /* Run elevated, e.g. by the setup; the cache is up to date when it succeeds */
+    if (g_bPublishCatalog)
+    {
+        InitializeCriticalSection(&g_csCatalog);
+        ret = (LoadKeyboardLayouts() && g_pCatalogImage) ? 0 : 1;
+        FreeKeyboardLayouts();
+        CloseSharedCatalog();
+        DeleteCriticalSection(&g_csCatalog);
+        return ret;
+    }
+
     hMutex = CreateMutex(NULL, TRUE, KBSWITCH_CLASS);
     if (!hMutex)
         return 1;
@@ -992,7 +5554,7 @@ int main(void)
         return 1;
     }
 
-    g_hInstance = hInstance;
+    InitializeCriticalSection(&g_csCatalog);
 
     ZeroMemory(&WndClass, sizeof(WndClass));
     WndClass.lpfnWndProc   = WindowProc;
@@ -1018,13 +5580,10 @@ int main(void)
     ShowWindow(hwnd, SW_SHOWNORMAL);
     UpdateWindow(hwnd);
 
-    while (GetMessage(&msg, NULL, 0, 0))
-    {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-    }
+    ret = RunMessageLoop(hwnd);
 
+    DeleteCriticalSection(&g_csCatalog);
     ReleaseMutex(hMutex);
     CloseHandle(hMutex);
-    return (INT)msg.wParam;
+    return ret;
 }
@@ -9,9 +9,153 @@
 #include "resource.h"
 
 #define KBSWITCH_CLASS TEXT("kbswitcher")
+#define KBSWITCH_REG_KEY TEXT("Software\\Katayama Hirofumi MZ\\kbswitch")
 
 #define WM_LANGUAGE             (WM_USER + 100)
 #define WM_WINDOWACTIVATED      (WM_USER + 101)
 #define WM_WINDOWCREATED        (WM_USER + 102)
 #define WM_WINDOWDESTROYED      (WM_USER + 103)
 #define WM_WINDOWSETFOCUS       (WM_USER + 104)
+#define WM_LAYOUTACTIVATED      (WM_USER + 105) /* wParam: sequence, lParam: succeeded */
+
+/* The events kbsdll posts; see KbsSetEventMask */
+#define KBS_EVENT_LANGUAGE      0x01    /* WM_LANGUAGE */
+#define KBS_EVENT_ACTIVATED     0x02    /* WM_WINDOWACTIVATED */
+#define KBS_EVENT_CREATED       0x04    /* WM_WINDOWCREATED */
+#define KBS_EVENT_DESTROYED     0x08    /* WM_WINDOWDESTROYED */
+#define KBS_EVENT_SETFOCUS      0x10    /* WM_WINDOWSETFOCUS */
+#define KBS_EVENT_ALL           0x1F
+
+/* Counters of kbsdll, shared by the processes of the session it is used in */
+typedef struct tagKBS_HOOK_COUNTERS
+{
+    LONG cPosted;
+    LONG cPostFailed;
+    LONG cProcesses;    /* The processes kbsdll has opened the state in */
+} KBS_HOOK_COUNTERS, *PKBS_HOOK_COUNTERS;
+
+/* A command of KbsActivateLayout, run by the hook on the target's thread */
+#define KBS_MAX_ACTIVATIONS     16
+
+#define KBS_ACTIVATION_FREE     0
+#define KBS_ACTIVATION_FILLING  1
+#define KBS_ACTIVATION_QUEUED   2
+#define KBS_ACTIVATION_RUNNING  3
+
+typedef struct tagKBS_ACTIVATION
+{
+    LONG lState;            /* KBS_ACTIVATION_* */
+    DWORD dwSeq;
+    DWORD dwThreadId;       /* The thread of the target window */
+    DWORD64 qwHKL;
+} KBS_ACTIVATION, *PKBS_ACTIVATION;
+
+/* Statistics, for diagnostics */
+typedef struct tagKBS_COUNTERS
+{
+    DWORD cEventsReceived;
+    DWORD cEventsCoalesced;
+    DWORD cEventsDropped;
+    DWORD cDrains;
+    DWORD cMaxQueueDepth;
+    DWORD dwMaxEventDelay;      /* In ms, from the post by kbsdll to the handling */
+    DWORD dwTotalEventDelay;
+    DWORD cActivationsDirect;   /* Activated by kbsdll on the target's thread */
+    DWORD cActivationsFallback; /* Requested with WM_INPUTLANGCHANGEREQUEST */
+    DWORD cLayoutCacheHits;
+    DWORD cLayoutCacheMisses;
+    DWORD cLayoutCacheEvictions;
+    DWORD cPropagations;        /* Of the global mode */
+    DWORD cPropagationSwitches; /* Threads asked to switch */
+    DWORD cPropagationSkips;    /* Threads already on the layout */
+    DWORD cPropagationDeferrals; /* Threads left for a later pass */
+    DWORD cLastPropagationWindows;
+    DWORD dwLastPropagationTime; /* In microseconds */
+    DWORD dwMaxPropagationTime;
+    DWORD cActivationTimeouts;  /* Activations by kbsdll that timed out */
+    DWORD cUnresponsiveSkips;   /* Requests not made to hung windows */
+    DWORD cSlowDrains;          /* Drains of the events that stalled */
+    DWORD dwMaxDrainTime;       /* In milliseconds */
+    DWORD cSpansDropped;        /* Of the profiling, for full buffers */
+    KBS_HOOK_COUNTERS Hook;
+} KBS_COUNTERS, *PKBS_COUNTERS;
+
+/*
+ * The control channel protocol.
+ *
+ * The client writes KBSCTL_REQUESTs to the pipe; kbswitch answers each of them
+ * in order with a KBSCTL_RESPONSE followed by cbData bytes of data. All the
+ * structures have a fixed layout, regardless of the bitness and of UNICODE.
+ */
+#define KBSCTL_PIPE_FORMAT TEXT("\\\\.\\pipe\\kbswitch.%lu") /* Session ID */
+
+#define KBSCTL_GET_STATE        1   /* Data: KBSCTL_STATE */
+#define KBSCTL_SET_LAYOUT       2   /* dwParam: the KLID */
+#define KBSCTL_LIST_LAYOUTS     3   /* Data: KBSCTL_LAYOUT[] */
+#define KBSCTL_GET_COUNTERS     4   /* Data: KBS_COUNTERS */
+#define KBSCTL_GET_HANDLES      5   /* Data: KBSCTL_HANDLES */
+#define KBSCTL_TRACE            6   /* dwParam: 1 starts, 0 stops; Data on stop: KBSCTL_SPAN[] */
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+    #define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+#ifndef FILE_FLAG_FIRST_PIPE_INSTANCE
+    #define FILE_FLAG_FIRST_PIPE_INSTANCE 0x00080000
+#endif
+
+typedef struct tagKBSCTL_REQUEST
+{
+    DWORD dwCommand;    /* KBSCTL_* */
+    DWORD dwParam;
+} KBSCTL_REQUEST, *PKBSCTL_REQUEST;
+
+typedef struct tagKBSCTL_RESPONSE
+{
+    DWORD dwCommand;    /* KBSCTL_* */
+    DWORD dwStatus;     /* ERROR_SUCCESS or an error code */
+    DWORD cbData;
+} KBSCTL_RESPONSE, *PKBSCTL_RESPONSE;
+
+typedef struct tagKBSCTL_STATE
+{
+    DWORD64 qwHKL;
+    DWORD64 qwLastActive;   /* HWND */
+    DWORD dwKLID;
+    DWORD dwReserved;
+} KBSCTL_STATE, *PKBSCTL_STATE;
+
+typedef struct tagKBSCTL_LAYOUT
+{
+    DWORD dwKLID;
+    DWORD dwVariant;
+    WCHAR szText[64];
+} KBSCTL_LAYOUT, *PKBSCTL_LAYOUT;
+
+/* The GDI/USER handles of a subsystem of kbswitch */
+typedef struct tagKBS_HANDLE_ACCOUNT
+{
+    LONG cLive;
+    LONG cPeak;
+    DWORD cCreated;
+} KBS_HANDLE_ACCOUNT, *PKBS_HANDLE_ACCOUNT;
+
+#define KBS_HANDLE_OWNERS       3   /* The tray, the menu, the icon drawing */
+
+typedef struct tagKBSCTL_HANDLES
+{
+    DWORD cGdiObjects;      /* GetGuiResources of the whole process */
+    DWORD cGdiPeak;
+    DWORD cUserObjects;
+    DWORD cUserPeak;
+    KBS_HANDLE_ACCOUNT Accounts[KBS_HANDLE_OWNERS];
+} KBSCTL_HANDLES, *PKBSCTL_HANDLES;
+
+/* A span of the profiling: the time a function took on a thread of kbswitch */
+typedef struct tagKBSCTL_SPAN
+{
+    DWORD64 qwBegin;        /* In microseconds since the session has started */
+    DWORD dwDuration;       /* In microseconds */
+    DWORD dwThreadId;
+    DWORD dwArg;            /* The message, the HKL, ... */
+    CHAR szName[28];
+} KBSCTL_SPAN, *PKBSCTL_SPAN;
@@ -6,7 +6,15 @@
 /* Menus */
 #define IDR_POPUP 12000
 
+/* Dialogs */
+#define IDD_SELECTLAYOUT 200
+
+/* Controls */
+#define IDC_FILTER  1000
+#define IDC_LAYOUTS 1001
+
 /* Menu items */
 #define ID_EXIT        10001
 #define ID_PREFERENCES 10002
 #define ID_NEXTLAYOUT  10003
+#define ID_SELECTLAYOUT 10004